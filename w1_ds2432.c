@@ -7,26 +7,37 @@
  * Version 2. See the file COPYING for more details.
  */
 
+#include <asm/unaligned.h>
+#include <linux/completion.h>
+#include <linux/crc16.h>
 #include <linux/crypto.h>
 #include <linux/cryptohash.h>
 #include <linux/delay.h>
 #include <linux/device.h>
+#include <linux/jump_label.h>
 #include <linux/kernel.h>
+#include <linux/key.h>
+#include <linux/ktime.h>
+#include <linux/kref.h>
+#include <linux/log2.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/nvmem-provider.h>
+#include <linux/regmap.h>
+#include <linux/rwsem.h>
 #include <linux/scatterlist.h>
 #include <linux/slab.h>
 #include <linux/types.h>
 #include <linux/w1.h>
+#include <linux/workqueue.h>
 
-#ifdef CONFIG_W1_SLAVE_DS2432_CRC
-#include <linux/crc16.h>
+#include "w1_ds2432.h"
+
+#include <keys/user-type.h>
 
 #define CRC16_INIT      0
 #define CRC16_VALID     0xb001
 
-#endif
-
 #define W1_EEPROM_DS2432                0xB3
 
 #define DS2432_WRITE_SCRATCHPAD         0x0F
@@ -35,13 +46,15 @@
 #define DS2432_LOAD_FIRST_SECRET        0x5A
 #define DS2432_READ_AUTHENTICATED       0xA5
 #define DS2432_READ_MEMORY              0xF0
+#define DS2432_COMPUTE_NEXT_SECRET      0x33
 
 // Memory map
 #define W1_DS2432_PAGE_0_ADDR           0x00
 #define W1_DS2432_PAGE_1_ADDR           0x20
 #define W1_DS2432_PAGE_2_ADDR           0x40
 #define W1_DS2432_PAGE_3_ADDR           0x60
-#define W1_DS2432_PAGE_SIZE             0x20
+// W1_DS2432_PAGE_SIZE and W1_DS2432_DATA_MEMORY_SIZE are in w1_ds2432.h
+#define W1_DS2432_PAGE_COUNT            4
 
 #define W1_DS2432_SECRET_ADDR           0x80
 #define W1_DS2432_SECRET_SIZE           0x10
@@ -49,11 +62,583 @@
 #define W1_DS2432_REGISTER_PAGE_ADDR    0x88
 #define W1_DS2432_REGISTER_PAGE_SIZE    0x10
 
-#define W1_DS2432_DATA_MEMORY_SIZE      0x80
+// Register page offsets (relative to W1_DS2432_REGISTER_PAGE_ADDR)
+#define W1_DS2432_REG_WP_SECRET         0x00
+#define W1_DS2432_REG_WP_PAGES_03       0x01
+#define W1_DS2432_REG_USER_BYTE         0x02
+#define W1_DS2432_REG_FACTORY_BYTE      0x03
+#define W1_DS2432_REG_EPROM_PAGE_1      0x04
+#define W1_DS2432_REG_WP_PAGE_0         0x05
+#define W1_DS2432_REG_MANUFACTURER_ID   0x06
+#define W1_DS2432_REG_REGISTRATION_NUM  0x08
+
+// Only the first 8 bytes of the register page (0088h to 008Fh) are writable,
+// and they are written as a single scratchpad block.
+#define W1_DS2432_REG_WRITABLE_SIZE     0x08
+
+#define W1_DS2432_PROTECT_CODE          0xAA
+
+#define W1_DS2432_BLOCK_SIZE            0x08
+#define W1_DS2432_BLOCK_COUNT           (W1_DS2432_DATA_MEMORY_SIZE / W1_DS2432_BLOCK_SIZE)
+
+#define W1_DS2432_TRACE_DEPTH           128
+
+// Scratchpad CRC16 verification for every slave, as set by the crc_check
+// parameter. A static branch, only ever flipped from the parameter, never on
+// the command path. Slaves whose link policy asks for the checks get them
+// through their own flag, see w1_b3_crc_check().
+static DEFINE_STATIC_KEY_FALSE(w1_ds2432_crc_check);
+static bool crc_check;
+
+static int w1_ds2432_crc_check_set(const char *val,
+                                   const struct kernel_param *kp) {
+  int error;
+
+  error = param_set_bool(val, kp);
+  if (error < 0) {
+    return error;
+  }
+
+  if (crc_check) {
+    static_branch_enable(&w1_ds2432_crc_check);
+  } else {
+    static_branch_disable(&w1_ds2432_crc_check);
+  }
+
+  return 0;
+}
+
+static const struct kernel_param_ops w1_ds2432_crc_check_ops = {
+    .set = w1_ds2432_crc_check_set,
+    .get = param_get_bool,
+};
+
+module_param_cb(crc_check, &w1_ds2432_crc_check_ops, &crc_check, 0644);
+MODULE_PARM_DESC(crc_check, "verify the CRC16 of scratchpad transfers");
+
+#define W1_DS2432_KEY_DESC_SIZE         128
+
+enum w1_ds2432_read_mode {
+  W1_DS2432_READ_PLAIN = 0, // Read Memory, no integrity check
+  W1_DS2432_READ_CRC,       // Read Authenticated Page, CRC16 checked
+  W1_DS2432_READ_MAC,       // same, plus the MAC checked against the secret
+};
+
+#define W1_DS2432_READ_RETRIES          3
+
+static unsigned int read_mode = W1_DS2432_READ_PLAIN;
+module_param(read_mode, uint, 0644);
+MODULE_PARM_DESC(read_mode, "default eeprom read mode for new slaves: 0 plain, "
+                            "1 CRC checked, 2 CRC and MAC checked");
+
+// Link quality
+//
+// Every command is a sample in two sliding windows, the slave's and its
+// master's, recording which errors it hit. The worse of the two sets the link
+// policy: how hard the slave's commands try, and how much they check.
+
+#define W1_DS2432_LINK_WINDOW           64
+
+enum w1_ds2432_link_error {
+  W1_DS2432_LINK_PRESENCE = 0, // no presence pulse on a reset
+  W1_DS2432_LINK_CRC,          // CRC16 mismatch, or data not echoed back
+  W1_DS2432_LINK_STATUS,       // unexpected status byte
+  W1_DS2432_LINK_ERROR_KINDS,
+};
+
+// The last W1_DS2432_LINK_WINDOW commands, one bit per command and error kind,
+// newest in bit 0.
+struct w1_ds2432_link {
+  u64 window[W1_DS2432_LINK_ERROR_KINDS];
+  unsigned int samples;
+};
+
+enum w1_ds2432_link_level {
+  W1_DS2432_LINK_GOOD = 0,
+  W1_DS2432_LINK_MARGINAL,
+  W1_DS2432_LINK_BAD,
+  W1_DS2432_LINK_AUTO, // not pinned, follow the windows
+};
+
+struct w1_ds2432_link_policy {
+  unsigned int read_retries;          // tries per page of a checked read
+  unsigned int presence_retries;      // resets retried before giving up
+  enum w1_ds2432_read_mode read_mode; // weakest eeprom read mode used
+  bool crc_check;                     // check scratchpad transfer CRCs
+  unsigned int margin_ms;             // added to device-internal waits
+};
+
+static const char *const w1_ds2432_link_levels[] = {
+    [W1_DS2432_LINK_GOOD]     = "good",
+    [W1_DS2432_LINK_MARGINAL] = "marginal",
+    [W1_DS2432_LINK_BAD]      = "bad",
+    [W1_DS2432_LINK_AUTO]     = "auto",
+};
+
+static const struct w1_ds2432_link_policy w1_ds2432_link_policies[] = {
+    [W1_DS2432_LINK_GOOD] = {
+        .read_retries = W1_DS2432_READ_RETRIES,
+        .read_mode = W1_DS2432_READ_PLAIN,
+    },
+    [W1_DS2432_LINK_MARGINAL] = {
+        .read_retries = W1_DS2432_READ_RETRIES,
+        .presence_retries = 1,
+        .read_mode = W1_DS2432_READ_CRC,
+        .crc_check = true,
+        .margin_ms = 1,
+    },
+    [W1_DS2432_LINK_BAD] = {
+        .read_retries = 5,
+        .presence_retries = 2,
+        .read_mode = W1_DS2432_READ_CRC,
+        .crc_check = true,
+        .margin_ms = 5,
+    },
+};
+
+static unsigned int link_marginal = 2;
+module_param(link_marginal, uint, 0644);
+MODULE_PARM_DESC(link_marginal, "failed commands within the last 64 that make "
+                                "a link marginal");
+
+static unsigned int link_bad = 8;
+module_param(link_bad, uint, 0644);
+MODULE_PARM_DESC(link_bad, "failed commands within the last 64 that make a "
+                           "link bad");
+
+static bool ecc;
+module_param(ecc, bool, 0644);
+MODULE_PARM_DESC(ecc, "default eeprom layout for new slaves: keep an error "
+                      "correcting code in the last two bytes of each page");
+
+static bool cache;
+module_param(cache, bool, 0644);
+MODULE_PARM_DESC(cache, "serve eeprom reads from a per-slave image cache");
+
+static unsigned int auth_ttl_ms = 60000;
+module_param(auth_ttl_ms, uint, 0644);
+MODULE_PARM_DESC(auth_ttl_ms, "how long an authentication verdict is served "
+                              "from cache, in ms (0: always authenticate)");
+
+static bool trace;
+module_param(trace, bool, 0644);
+MODULE_PARM_DESC(trace, "record every DS2432 command in the per-slave "
+                        "transaction_log attribute");
+
+// One transaction log record, as exported through the transaction_log
+// attribute. The layout is fixed and little-endian so that a log taken on a
+// target can be decoded and replayed elsewhere.
+struct w1_ds2432_trace_record {
+  __le64 timestamp_ns; // ktime_get_ns() when the command started
+  __le32 duration_ns;  // time spent on the bus, including device waits
+  __le32 master_id;    // w1 master the slave sits on
+  __le16 address;      // target address (TA2:TA1)
+  __le16 length;       // bytes of data transferred
+  u8 command;          // DS2432_* command byte
+  u8 reserved;
+  __le16 result;       // 0 or a negative errno
+} __packed;
+
+// Master key mode: when a master key is configured, each slave's secret is
+// derived from it and the slave's registration number, unless a secret was
+// written explicitly through the secret attribute.
+static DEFINE_MUTEX(w1_ds2432_master_key_lock);
+static u8 w1_ds2432_master_key[8];
+// Bumped on every master key change; 0 means no master key is configured.
+static unsigned int w1_ds2432_master_key_gen;
+
+static int w1_ds2432_master_key_set(const char *val,
+                                    const struct kernel_param *kp) {
+  static unsigned int generation;
+  u8 key[8];
+  size_t len = strlen(val);
+
+  if (len && val[len - 1] == '\n') {
+    len--;
+  }
+
+  if (len != 0 && (len != 2 * sizeof(key) || hex2bin(key, val, sizeof(key)))) {
+    return -EINVAL;
+  }
+
+  mutex_lock(&w1_ds2432_master_key_lock);
+  if (len == 0) {
+    memzero_explicit(w1_ds2432_master_key, sizeof(w1_ds2432_master_key));
+    w1_ds2432_master_key_gen = 0;
+  } else {
+    memcpy(w1_ds2432_master_key, key, sizeof(key));
+    // Never hand out 0, it means "no master key".
+    if (++generation == 0) {
+      generation++;
+    }
+    w1_ds2432_master_key_gen = generation;
+  }
+  mutex_unlock(&w1_ds2432_master_key_lock);
+
+  memzero_explicit(key, sizeof(key));
+
+  return 0;
+}
+
+static const struct kernel_param_ops w1_ds2432_master_key_ops = {
+    .set = w1_ds2432_master_key_set,
+};
+
+module_param_cb(master_key, &w1_ds2432_master_key_ops, NULL, 0200);
+MODULE_PARM_DESC(master_key, "16 hex digits; derive every slave's secret from "
+                             "this key and its registration number (write an "
+                             "empty string to clear)");
+
+// Secret table: secrets for mixed fleets, matched on a registration number
+// prefix or on the manufacturer ID. Entries are appended through the
+// write-only `secret_table` module parameter.
+#define W1_DS2432_SECRET_TABLE_SIZE     16
+
+struct w1_ds2432_secret_entry {
+  u8 match[8];
+  u8 match_len;         // bytes of `match` that must match
+  bool manufacturer_id; // match the manufacturer ID instead of the ROM ID
+  u8 secret[8];
+};
+
+static DEFINE_MUTEX(w1_ds2432_secret_table_lock);
+static struct w1_ds2432_secret_entry
+    w1_ds2432_secret_table[W1_DS2432_SECRET_TABLE_SIZE];
+static unsigned int w1_ds2432_secret_table_len;
+// Bumped on every table change; slaves re-match lazily when it moves.
+static unsigned int w1_ds2432_secret_table_gen;
+
+// Parse a device match: "rom" with a ROM ID prefix in registration_number byte
+// order (family code first), or "mfg" with a manufacturer ID in register page
+// order (008Eh first).
+static int w1_ds2432_parse_match(const char *kind, const char *hex, u8 *match,
+                                 u8 *match_len, bool *manufacturer_id) {
+  size_t match_hex = strlen(hex);
+
+  if (!strcmp(kind, "rom")) {
+    *manufacturer_id = false;
+  } else if (!strcmp(kind, "mfg")) {
+    *manufacturer_id = true;
+  } else {
+    return -EINVAL;
+  }
+
+  if (match_hex == 0 || match_hex % 2 ||
+      match_hex / 2 > (*manufacturer_id ? 2 : 8) ||
+      hex2bin(match, hex, match_hex / 2)) {
+    return -EINVAL;
+  }
+  *match_len = match_hex / 2;
+
+  return 0;
+}
+
+// Accepts "rom:<hex prefix>=<secret>", "mfg:<hex id>=<secret>" or "clear".
+static int w1_ds2432_secret_table_set(const char *val,
+                                      const struct kernel_param *kp) {
+  struct w1_ds2432_secret_entry entry = {0};
+  char *line, *kind, *match, *secret;
+  int error = 0;
+
+  line = kstrdup(val, GFP_KERNEL);
+  if (!line) {
+    return -ENOMEM;
+  }
+
+  secret = strim(line);
+
+  if (!strcmp(secret, "clear")) {
+    mutex_lock(&w1_ds2432_secret_table_lock);
+    memzero_explicit(w1_ds2432_secret_table, sizeof(w1_ds2432_secret_table));
+    w1_ds2432_secret_table_len = 0;
+    w1_ds2432_secret_table_gen++;
+    mutex_unlock(&w1_ds2432_secret_table_lock);
+    goto out;
+  }
+
+  kind = strsep(&secret, ":");
+  match = strsep(&secret, "=");
+  if (!secret || !match) {
+    error = -EINVAL;
+    goto out;
+  }
+
+  error = w1_ds2432_parse_match(kind, match, entry.match, &entry.match_len,
+                                &entry.manufacturer_id);
+  if (error < 0) {
+    goto out;
+  }
+
+  if (strlen(secret) != 2 * sizeof(entry.secret) ||
+      hex2bin(entry.secret, secret, sizeof(entry.secret))) {
+    error = -EINVAL;
+    goto out;
+  }
+
+  mutex_lock(&w1_ds2432_secret_table_lock);
+  if (w1_ds2432_secret_table_len == W1_DS2432_SECRET_TABLE_SIZE) {
+    error = -ENOSPC;
+  } else {
+    w1_ds2432_secret_table[w1_ds2432_secret_table_len++] = entry;
+    w1_ds2432_secret_table_gen++;
+  }
+  mutex_unlock(&w1_ds2432_secret_table_lock);
+
+out:
+  memzero_explicit(&entry, sizeof(entry));
+  kzfree(line);
+
+  return error;
+}
+
+static const struct kernel_param_ops w1_ds2432_secret_table_ops = {
+    .set = w1_ds2432_secret_table_set,
+};
+
+module_param_cb(secret_table, &w1_ds2432_secret_table_ops, NULL, 0200);
+MODULE_PARM_DESC(secret_table, "add a secret matched on ROM ID prefix "
+                               "(rom:<hex>=<secret>) or manufacturer ID "
+                               "(mfg:<hex>=<secret>), or clear the table");
+
+enum w1_ds2432_page_state {
+  W1_DS2432_PAGE_EMPTY = 0,  // nothing cached
+  W1_DS2432_PAGE_UNVERIFIED, // imported, not yet confirmed against the device
+  W1_DS2432_PAGE_TRUSTED,    // read from or written to the device
+};
+
+// Cached image as exported and imported through the cache_image attribute.
+#define W1_DS2432_CACHE_MAGIC           "B3C1"
+
+struct w1_ds2432_cache_record {
+  u8 magic[4];
+  u8 registration_number[8];
+  u8 page_valid; // bit n set: page n of `image` is meaningful
+  u8 reserved[3];
+  u8 image[W1_DS2432_DATA_MEMORY_SIZE];
+} __packed;
+
+enum w1_ds2432_secret_source {
+  W1_DS2432_SECRET_DEFAULT = 0, // never set, all zeros
+  W1_DS2432_SECRET_USER,        // written through the secret attribute
+  W1_DS2432_SECRET_DERIVED,     // derived from the master key
+  W1_DS2432_SECRET_TABLE,       // picked from the secret table
+  W1_DS2432_SECRET_KEY,         // resolved from a keyring key
+  W1_DS2432_SECRET_ROTATED,     // installed by a secret rotation job
+};
+
+// Progress of a slave through a secret rotation job, see w1_b3_rotate().
+enum w1_ds2432_rotation_state {
+  W1_DS2432_ROTATION_NONE = 0, // not part of the job yet
+  W1_DS2432_ROTATION_ISSUED,   // secret command sent, outcome unknown
+  W1_DS2432_ROTATION_DONE,     // new secret verified and in use
+  W1_DS2432_ROTATION_FAILED,   // device refused the new secret
+};
+
+// Journal entry as exported and imported through the rotation attribute.
+#define W1_DS2432_ROTATION_MAGIC        "B3R1"
+
+struct w1_ds2432_rotation_record {
+  u8 magic[4];
+  u8 registration_number[8];
+  __le32 job;   // rotation job ID, 0 for none
+  u8 state;     // enum w1_ds2432_rotation_state
+  u8 reserved[3];
+  __le32 error; // errno of the last failed step, 0 for none
+} __packed;
+
+// One data memory read or write waiting in a slave's request queue.
+struct w1_ds2432_request {
+  struct list_head entry;
+  bool write;
+  u16 off;
+  u16 count;
+  u8 *buf;
+  int result;
+  struct completion done;
+  // Woken to take over dispatching rather than served.
+  bool dispatch;
+};
+
+// Named fields of the data memory, see the field schema section.
+#define W1_DS2432_FIELD_NAME_SIZE       16
+#define W1_DS2432_FIELD_MAX             16
+
+enum w1_ds2432_field_type {
+  W1_DS2432_FIELD_U8 = 0, // unsigned, as decimal text
+  W1_DS2432_FIELD_U16,    // little-endian unsigned, as decimal text
+  W1_DS2432_FIELD_U32,    // little-endian unsigned, as decimal text
+  W1_DS2432_FIELD_STR,    // NUL-padded string
+  W1_DS2432_FIELD_RAW,    // raw bytes
+  W1_DS2432_FIELD_COUNTER, // usage counter, see w1_b3_counter_add()
+};
+
+struct w1_ds2432_field {
+  char name[W1_DS2432_FIELD_NAME_SIZE];
+  u8 offset;
+  u8 length;
+  enum w1_ds2432_field_type type;
+};
+
+struct w1_ds2432_field_attr {
+  struct bin_attribute attr;
+  struct w1_slave *sl;
+  struct w1_ds2432_field field;
+};
+
+// Per-master state, see the change-detection scanner.
+struct w1_ds2432_master {
+  struct list_head entry; // in w1_ds2432_masters
+  struct w1_master *master;
+  // Attached slaves, least recently scanned first; protected by lock.
+  struct mutex lock;
+  struct list_head slaves;
+  unsigned int slave_count;
+  struct delayed_work scan_work;
+  // Link quality of the whole bus, protected by the master bus_mutex.
+  struct w1_ds2432_link link;
+};
+
+static LIST_HEAD(w1_ds2432_masters);
+static DEFINE_MUTEX(w1_ds2432_masters_lock);
+
+// Driver workqueue for bus work that runs on its own: change-detection scans
+// and secret rotation jobs, which can hold a bus for long stretches. Destroyed,
+// and so drained, at module exit.
+static struct workqueue_struct *w1_ds2432_wq;
 
 struct w1_b3_data {
   u8 secret[8];
   u8 registration_number[8];
+
+  struct w1_slave *sl;
+  // Per-master bookkeeping, and this slave's entry in its slave list. Set and
+  // cleared under the master bus_mutex.
+  struct w1_ds2432_master *bus;
+  struct list_head bus_entry;
+  // Next page the change-detection scanner checks.
+  u8 scan_page;
+
+  // Set when the device stopped answering resets during the current
+  // operation. Protected by the master bus_mutex.
+  bool absent;
+
+  // Link quality of this slave, and the link level it is pinned at, if any.
+  // Protected by the master bus_mutex.
+  struct w1_ds2432_link link;
+  enum w1_ds2432_link_level link_pin;
+  // Whether the link policy of this slave asks for scratchpad CRC checks,
+  // updated on every reset.
+  bool link_crc;
+
+  // Where `secret` came from, and for derived secrets the master key
+  // generation it was derived from. Protected by the master bus_mutex.
+  enum w1_ds2432_secret_source secret_source;
+  unsigned int secret_gen;
+  // Secret table generation this slave was last matched against.
+  unsigned int secret_table_gen;
+
+  // Keyring key backing the secret (W1_DS2432_SECRET_KEY) and its
+  // description. Once the key is revoked or expired it is marked stale and
+  // looked up again by key_work, outside the bus_mutex.
+  struct key *secret_key;
+  char *secret_key_desc;
+  bool secret_key_stale;
+  struct work_struct key_work;
+
+  // Copy scratchpad MAC input prepared for the current secret.
+  u8 mac_template[64];
+  bool mac_template_valid;
+
+  // Data memory requests waiting for the bus. Whoever finds the queue idle
+  // dispatches it, serving every request queued meanwhile as one batch.
+  // Protected by queue_lock, which nests inside the bus_mutex.
+  struct mutex queue_lock;
+  struct list_head queue;
+  bool dispatching;
+
+  // nvmem provider over the data memory, NULL when nvmem is unavailable.
+  struct nvmem_device *nvmem;
+
+  // Handle given to in-kernel users, see w1_ds2432.h.
+  struct w1_ds2432 *handle;
+
+  // Register page regmap, and whether its cache was loaded from the device.
+  // Used with the master bus_mutex held.
+  struct regmap *regmap;
+  bool regs_valid;
+
+  // How eeprom_read() talks to the device, see enum w1_ds2432_read_mode.
+  enum w1_ds2432_read_mode read_mode;
+
+  // Whether pages carry an error correcting code, see w1_ds2432_ecc_correct(),
+  // and how it has fared. Protected by the master bus_mutex.
+  bool ecc;
+  unsigned int ecc_corrected;
+  unsigned int ecc_rereads;
+  unsigned int ecc_failed;
+
+  // Image of the data memory, valid per page as told by page_state, and a
+  // generation bumped whenever its content may have changed. Protected by the
+  // master bus_mutex.
+  u8 image[W1_DS2432_DATA_MEMORY_SIZE];
+  enum w1_ds2432_page_state page_state[W1_DS2432_PAGE_COUNT];
+  unsigned int image_gen;
+
+  // Record store index, see w1_b3_records_load(): offset of each record ID in
+  // the image (0: absent), valid for image generation records_gen. Protected
+  // by the master bus_mutex.
+  u8 record_offset[256];
+  u8 records_end;
+  bool records_present;
+  bool records_valid;
+  unsigned int records_gen;
+
+  // First free byte of the EPROM mode log in page 1, valid for image
+  // generation eprom_tail_gen. Protected by the master bus_mutex.
+  u8 eprom_tail;
+  bool eprom_tail_valid;
+  unsigned int eprom_tail_gen;
+
+  // Serializes read-modify-write updates of the data memory (records,
+  // counters, log, scripts); taken inside the master's lock and outside the
+  // bus_mutex.
+  struct mutex update_lock;
+
+  // Field schema set on this slave (overrides the manufacturer schema), and
+  // the attributes of the schema in effect. Protected by fields_lock.
+  struct w1_ds2432_field fields[W1_DS2432_FIELD_MAX];
+  unsigned int field_count;
+  struct kobject *fields_kobj;
+  struct w1_ds2432_field_attr *field_attrs;
+  unsigned int field_attr_count;
+  struct mutex fields_lock;
+  // The manufacturer ID could not be read; retry the fields on next access.
+  bool fields_pending;
+
+  // Journal entry of the last secret rotation job that reached this slave.
+  // Protected by the master bus_mutex.
+  u32 rotation_job;
+  enum w1_ds2432_rotation_state rotation_state;
+  int rotation_error;
+
+  // Last authentication verdict (0: genuine, -EACCES: not genuine) and when
+  // it was established, in jiffies.
+  bool auth_valid;
+  int auth_verdict;
+  unsigned long auth_stamp;
+
+  // Transaction log ring, protected by the master bus_mutex.
+  struct w1_ds2432_trace_record trace[W1_DS2432_TRACE_DEPTH];
+  unsigned int trace_head;
+  unsigned int trace_count;
+
+  // Loaded transaction script and the results of its last run, protected by
+  // script_lock; taken outside every other lock.
+  u8 *script;
+  size_t script_len;
+  u8 *script_output;
+  size_t script_output_len;
+  struct mutex script_lock;
 };
 
 // Compute the 160-bit MAC
@@ -159,12 +744,209 @@ static inline size_t w1_b3_fix_count(loff_t off, size_t count, size_t size) {
   return count;
 }
 
+// Forget the cached authentication verdict; called whenever the secret or the
+// device content may have changed. The caller must hold the bus_mutex.
+static inline void w1_b3_invalidate_verdict(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+
+  if (b3_data) {
+    b3_data->auth_valid = false;
+  }
+}
+
+// Forget every cached page. The caller must hold the bus_mutex.
+static void w1_b3_invalidate_cache(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  int page;
+
+  for (page = 0; page < W1_DS2432_PAGE_COUNT; page++) {
+    b3_data->page_state[page] = W1_DS2432_PAGE_EMPTY;
+  }
+  b3_data->image_gen++;
+
+  // The register page goes with it; the next register access reads it again.
+  b3_data->regs_valid = false;
+}
+
+// Take the bus for one operation on this slave. Every operation starts by
+// assuming the device is present; the first reset without presence pulse
+// marks it absent for the rest of the operation.
+static void w1_b3_lock(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+
+  mutex_lock(&sl->master->bus_mutex);
+  b3_data->absent = false;
+}
+
+static void w1_b3_unlock(struct w1_slave *sl) {
+  mutex_unlock(&sl->master->bus_mutex);
+}
+
+static unsigned int w1_ds2432_link_errors(const struct w1_ds2432_link *link) {
+  u64 failed = 0;
+  int kind;
+
+  for (kind = 0; kind < W1_DS2432_LINK_ERROR_KINDS; kind++) {
+    failed |= link->window[kind];
+  }
+
+  return hweight64(failed);
+}
+
+static enum w1_ds2432_link_level
+w1_ds2432_link_level(const struct w1_ds2432_link *link) {
+  unsigned int errors = w1_ds2432_link_errors(link);
+
+  if (errors >= READ_ONCE(link_bad)) {
+    return W1_DS2432_LINK_BAD;
+  }
+  if (errors >= READ_ONCE(link_marginal)) {
+    return W1_DS2432_LINK_MARGINAL;
+  }
+  return W1_DS2432_LINK_GOOD;
+}
+
+// Link level the slave's commands run at: the pinned one, or the worse of the
+// slave's and the master's. The caller must hold the bus_mutex.
+static enum w1_ds2432_link_level w1_b3_link_level(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  enum w1_ds2432_link_level level;
+
+  if (b3_data->link_pin != W1_DS2432_LINK_AUTO) {
+    return b3_data->link_pin;
+  }
+
+  level = w1_ds2432_link_level(&b3_data->link);
+  if (b3_data->bus) {
+    level = max(level, w1_ds2432_link_level(&b3_data->bus->link));
+  }
+
+  return level;
+}
+
+static const struct w1_ds2432_link_policy *
+w1_b3_link_policy(struct w1_slave *sl) {
+  return &w1_ds2432_link_policies[w1_b3_link_level(sl)];
+}
+
+static void w1_ds2432_link_shift(struct w1_ds2432_link *link) {
+  int kind;
+
+  for (kind = 0; kind < W1_DS2432_LINK_ERROR_KINDS; kind++) {
+    link->window[kind] <<= 1;
+  }
+  if (link->samples < W1_DS2432_LINK_WINDOW) {
+    link->samples++;
+  }
+}
+
+// Open a new sample, at the reset every command starts with. The caller must
+// hold the bus_mutex.
+static void w1_b3_link_sample(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+
+  w1_ds2432_link_shift(&b3_data->link);
+  if (b3_data->bus) {
+    w1_ds2432_link_shift(&b3_data->bus->link);
+  }
+}
+
+// Record that the current command hit `error`. The caller must hold the
+// bus_mutex.
+static void w1_b3_link_error(struct w1_slave *sl,
+                             enum w1_ds2432_link_error error) {
+  struct w1_b3_data *b3_data = sl->family_data;
+
+  b3_data->link.window[error] |= 1;
+  if (b3_data->bus) {
+    b3_data->bus->link.window[error] |= 1;
+  }
+}
+
+/**
+ * Reset the bus and select the slave.
+ *
+ * When the device does not answer the reset it was removed: the cached state
+ * is dropped and this, as well as every later command of the same operation,
+ * fails with -ENODEV without touching the bus. Multi-block operations thus
+ * give up at the first missing presence pulse instead of running every
+ * remaining block into reset, select and timeouts. On a poor link the reset is
+ * retried a few times first, as told by the link policy.
+ *
+ * The caller must hold the bus_mutex.
+ */
+static int w1_ds2432_reset_select(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  const struct w1_ds2432_link_policy *policy = w1_b3_link_policy(sl);
+  unsigned int retries = policy->presence_retries;
+  unsigned int attempt;
+
+  if (b3_data->absent) {
+    return -ENODEV;
+  }
+
+  // Looked up once per command rather than in the scratchpad paths.
+  b3_data->link_crc = policy->crc_check;
+
+  for (attempt = 0; attempt <= retries; attempt++) {
+    w1_b3_link_sample(sl);
+    if (!w1_reset_select_slave(sl)) {
+      return 0;
+    }
+    w1_b3_link_error(sl, W1_DS2432_LINK_PRESENCE);
+  }
+
+  dev_dbg(&sl->dev, "no presence pulse, device removed\n");
+  b3_data->absent = true;
+  w1_b3_invalidate_cache(sl);
+  w1_b3_invalidate_verdict(sl);
+
+  return -ENODEV;
+}
+
+// Whether to check the scratchpad CRC16 of the command being run, after its
+// w1_ds2432_reset_select().
+static bool w1_b3_crc_check(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+
+  return static_branch_unlikely(&w1_ds2432_crc_check) || b3_data->link_crc;
+}
+
+// Record one command in the slave's transaction log. Must be called with the
+// bus_mutex held, like every command helper below.
+static void w1_ds2432_trace(struct w1_slave *sl, u8 command, u16 address,
+                            size_t length, u64 start_ns, int result) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  struct w1_ds2432_trace_record *record;
+
+  if (!trace || !b3_data) {
+    return;
+  }
+
+  record = &b3_data->trace[b3_data->trace_head];
+  record->timestamp_ns = cpu_to_le64(start_ns);
+  record->duration_ns = cpu_to_le32((u32)(ktime_get_ns() - start_ns));
+  record->master_id = cpu_to_le32(sl->master->id);
+  record->address = cpu_to_le16(address);
+  record->length = cpu_to_le16(length);
+  record->command = command;
+  record->reserved = 0;
+  record->result = cpu_to_le16((u16)result);
+
+  b3_data->trace_head = (b3_data->trace_head + 1) % W1_DS2432_TRACE_DEPTH;
+  if (b3_data->trace_count < W1_DS2432_TRACE_DEPTH) {
+    b3_data->trace_count++;
+  }
+}
+
 static int w1_ds2432_read_memory(struct w1_slave *sl, int address, u8 *memory,
                                  size_t count) {
   u8 wrbuf[3];
+  u64 start_ns = ktime_get_ns();
 
-  if (w1_reset_select_slave(sl)) {
-    return -EIO;
+  if (w1_ds2432_reset_select(sl) < 0) {
+    w1_ds2432_trace(sl, DS2432_READ_MEMORY, address, count, start_ns, -ENODEV);
+    return -ENODEV;
   }
 
   // Command
@@ -176,52 +958,60 @@ static int w1_ds2432_read_memory(struct w1_slave *sl, int address, u8 *memory,
   w1_write_block(sl->master, wrbuf, sizeof(wrbuf));
   w1_read_block(sl->master, memory, count);
 
+  w1_ds2432_trace(sl, DS2432_READ_MEMORY, address, count, start_ns, 0);
+
   return 0;
 }
 
 static int w1_ds2432_write_scratchpad(struct w1_slave *sl, int address,
                                       const u8 *data) {
-  u8 wrbuf[11] = {0};
-  u16 ds2432_scratchpad_crc = 0;
-  u16 my_scratchpad_crc = 0;
-
-  if (w1_reset_select_slave(sl)) {
-    return -EIO;
+  u8 wrbuf[3] = {0};
+  u8 ds2432_scratchpad_crc[2] = {0};
+  u16 crc = CRC16_INIT;
+  u64 start_ns = ktime_get_ns();
+  bool check_crc;
+
+  if (w1_ds2432_reset_select(sl) < 0) {
+    w1_ds2432_trace(sl, DS2432_WRITE_SCRATCHPAD, address, 8, start_ns, -ENODEV);
+    return -ENODEV;
   }
+  check_crc = w1_b3_crc_check(sl);
 
   wrbuf[0] = DS2432_WRITE_SCRATCHPAD;
   wrbuf[1] = (u8)(address & 0xff);
   wrbuf[2] = (u8)(address >> 8);
 
-  wrbuf[3] = data[0];
-  wrbuf[4] = data[1];
-  wrbuf[5] = data[2];
-  wrbuf[6] = data[3];
-  wrbuf[7] = data[4];
-  wrbuf[8] = data[5];
-  wrbuf[9] = data[6];
-  wrbuf[10] = data[7];
-
+  // The CRC16 is accumulated as the bytes go out, straight from the caller's
+  // buffer.
   w1_write_block(sl->master, wrbuf, sizeof(wrbuf));
+  if (check_crc) {
+    crc = crc16(crc, wrbuf, sizeof(wrbuf));
+  }
 
-  // Read inverted CRC16
-  w1_read_block(sl->master, (u8 *)&ds2432_scratchpad_crc, 2);
+  w1_write_block(sl->master, data, 8);
+  if (check_crc) {
+    crc = crc16(crc, data, 8);
+  }
 
-#ifdef CONFIG_W1_SLAVE_DS2432_CRC
-  my_scratchpad_crc = crc16(0, wrbuf, sizeof(wrbuf));
+  // Read inverted CRC16
+  w1_read_block(sl->master, ds2432_scratchpad_crc, 2);
 
   // Under certain conditions (see Write Scratchpad command) the master will
-  // receive an inverted CRC16 of the command,
-  ds2432_scratchpad_crc = ~ds2432_scratchpad_crc;
-
-  if (my_scratchpad_crc != ds2432_scratchpad_crc) {
-    dev_err(
-        &sl->dev,
-        "write_scratchpad: invalid checksum: received %04x but expected %04x\n",
-        ds2432_scratchpad_crc, my_scratchpad_crc);
-    return -EIO;
+  // receive an inverted CRC16 of the command, address and data; running it
+  // through the CRC leaves the CRC16_VALID residue.
+  if (check_crc) {
+    crc = crc16(crc, ds2432_scratchpad_crc, 2);
+    if (crc != CRC16_VALID) {
+      dev_err(&sl->dev, "write_scratchpad: invalid checksum (residue %04x)\n",
+              crc);
+      w1_b3_link_error(sl, W1_DS2432_LINK_CRC);
+      w1_ds2432_trace(sl, DS2432_WRITE_SCRATCHPAD, address, 8, start_ns,
+                      -EIO);
+      return -EIO;
+    }
   }
-#endif
+
+  w1_ds2432_trace(sl, DS2432_WRITE_SCRATCHPAD, address, 8, start_ns, 0);
 
   return 0;
 }
@@ -230,48 +1020,59 @@ static int w1_ds2432_read_scratchpad(struct w1_slave *sl, u16 *address, u8 *es,
                                      u8 *data) {
   u8 wrbuf[1] = {0};
   u8 rdbuf[3] = {0};
-  u16 ds2432_scratchpad_crc = 0;
-  u16 my_scratchpad_crc = 0;
-
-  if (w1_reset_select_slave(sl)) {
-    return -EIO;
+  u8 ds2432_scratchpad_crc[2] = {0};
+  u16 crc = CRC16_INIT;
+  u64 start_ns = ktime_get_ns();
+  bool check_crc;
+
+  if (w1_ds2432_reset_select(sl) < 0) {
+    w1_ds2432_trace(sl, DS2432_READ_SCRATCHPAD, 0, 8, start_ns, -ENODEV);
+    return -ENODEV;
   }
+  check_crc = w1_b3_crc_check(sl);
 
   // Command
   wrbuf[0] = DS2432_READ_SCRATCHPAD;
 
   // Write command
   w1_write_block(sl->master, wrbuf, 1);
+  if (check_crc) {
+    crc = crc16(crc, wrbuf, 1);
+  }
 
   // Read TA1,TA2,ES
   w1_read_block(sl->master, rdbuf, 3);
+  if (check_crc) {
+    crc = crc16(crc, rdbuf, 3);
+  }
 
   *address = ((u16)(rdbuf[1] << 8) | rdbuf[0]);
   *es = rdbuf[2];
 
   // Read the content of the scratchpad (8 bytes)
   w1_read_block(sl->master, data, 8);
+  if (check_crc) {
+    crc = crc16(crc, data, 8);
+  }
 
   // Read inverted CRC16
-  w1_read_block(sl->master, (u8 *)&ds2432_scratchpad_crc, 2);
-
-#ifdef CONFIG_W1_SLAVE_DS2432_CRC
-  my_scratchpad_crc = crc16(0, wrbuf, 1);
-  my_scratchpad_crc = crc16(my_scratchpad_crc, rdbuf, 3);
-  my_scratchpad_crc = crc16(my_scratchpad_crc, data, 8);
+  w1_read_block(sl->master, ds2432_scratchpad_crc, 2);
 
   // Under certain conditions (see Read Scratchpad command) the master will
   // receive an inverted CRC16 of the command,
-  ds2432_scratchpad_crc = ~ds2432_scratchpad_crc;
-
-  if (my_scratchpad_crc != ds2432_scratchpad_crc) {
-    dev_err(
-        &sl->dev,
-        "read_scratchpad: invalid checksum: received %04x but expected %04x\n",
-        ds2432_scratchpad_crc, my_scratchpad_crc);
-    return -EIO;
+  if (check_crc) {
+    crc = crc16(crc, ds2432_scratchpad_crc, 2);
+    if (crc != CRC16_VALID) {
+      dev_err(&sl->dev, "read_scratchpad: invalid checksum (residue %04x)\n",
+              crc);
+      w1_b3_link_error(sl, W1_DS2432_LINK_CRC);
+      w1_ds2432_trace(sl, DS2432_READ_SCRATCHPAD, *address, 8, start_ns,
+                      -EIO);
+      return -EIO;
+    }
   }
-#endif
+
+  w1_ds2432_trace(sl, DS2432_READ_SCRATCHPAD, *address, 8, start_ns, 0);
 
   return 0;
 }
@@ -280,11 +1081,15 @@ static int w1_ds2432_load_first_secret(struct w1_slave *sl, u16 address,
                                        u8 es) {
   u8 load_first_secret[4] = {0};
   u8 success;
+  u64 start_ns = ktime_get_ns();
 
-  if (w1_reset_select_slave(sl)) {
-    return -EIO;
+  if (w1_ds2432_reset_select(sl) < 0) {
+    w1_ds2432_trace(sl, DS2432_LOAD_FIRST_SECRET, address, 0, start_ns, -ENODEV);
+    return -ENODEV;
   }
 
+  w1_b3_invalidate_verdict(sl);
+
   load_first_secret[0] = DS2432_LOAD_FIRST_SECRET;
   load_first_secret[1] = address & 0xff;
   load_first_secret[2] = address >> 8;
@@ -294,7 +1099,7 @@ static int w1_ds2432_load_first_secret(struct w1_slave *sl, u16 address,
 
   // The device-internal data transfer takes 10 ms maximum during which the
   // voltage on the 1-Wire bus must not fall below 2.8V
-  msleep(10);
+  msleep(10 + w1_b3_link_policy(sl)->margin_ms);
 
   // A pattern of alternating 1s and 0s will be transmitted after the data has
   // been copied until the master issues a reset pulse.
@@ -302,43 +1107,73 @@ static int w1_ds2432_load_first_secret(struct w1_slave *sl, u16 address,
 
   if (success != 0xAA && success != 0x55) {
     dev_err(&sl->dev, "unable to load_first_secret, code %02x\n", success);
+    w1_b3_link_error(sl, W1_DS2432_LINK_STATUS);
+    w1_ds2432_trace(sl, DS2432_LOAD_FIRST_SECRET, address, 0, start_ns, -EIO);
     return -EIO;
   }
 
+  w1_ds2432_trace(sl, DS2432_LOAD_FIRST_SECRET, address, 0, start_ns, 0);
+
   return 0;
 }
 
 /**
- * Generate MAC for copy scratchpad operation
+ * Prepare the per-device part of the copy scratchpad MAC input
+ *
+ * The secret, the serial number and the padding never change between two
+ * copies, so they are laid out once in a 64-byte template which
+ * generate_mac_from_template() completes for every block.
  *
  * secret: 8 bytes, actual secret
+ * serial_number: device serial_number
+ * template: 64 bytes, prepared message
+ */
+static void prepare_mac_template(const u8 *secret, const u8 *serial_number,
+                                 u8 *template) {
+  memset(template, 0, 64);
+
+  // First half of the secret.
+  memcpy(&template[0], &secret[0], 4);
+
+  // template[41] is family_code, which is conveniently the first byte of the
+  // serial_number.
+  memcpy(&template[41], serial_number, 7);
+
+  // Second half of the secret.
+  memcpy(&template[48], &secret[4], 4);
+
+  // Magic numbers taken from the datasheet.
+  template[52] = 0xff;
+  template[53] = 0xff;
+  template[54] = 0xff;
+  template[55] = 0x80;
+
+  template[62] = 0x01;
+  template[63] = 0xb8;
+}
+
+/**
+ * Generate MAC for copy scratchpad operation from a prepared template
+ *
+ * template: 64 bytes, from prepare_mac_template()
  * scratchpad: 8 bytes, scratchpad data
  * memory_page: page number (1 to 3 inclusive) or 0 for scratchpad
  * data_memory_page: the first 28 bytes of the addressed memory page
- * serial_number: device serial_number
  * sha1: generated MAC
  */
-static void generate_mac(const u8 *secret, const u8 *scratchpad,
-                         u16 memory_page, const u8 *data_memory_page,
-                         const u8 *serial_number, struct sha1 *sha1,
-                         struct w1_slave *sl) {
-  u8 message[64] = {0};
-  u8 i = 0;
+static void generate_mac_from_template(const u8 *template,
+                                       const u8 *scratchpad, u16 memory_page,
+                                       const u8 *data_memory_page,
+                                       struct sha1 *sha1) {
+  u8 message[64];
 
-  // First half of the secret.
-  for (i = 0; i < 4; i++) {
-    message[i] = secret[i];
-  }
+  memcpy(message, template, sizeof(message));
 
   // Data in the memory page.
-  for (i = 4; i < 32; i++) {
-    message[i] = data_memory_page[i - 4];
-  }
+  memcpy(&message[4], data_memory_page, 28);
 
   // Scratchpad content.
-  for (i = 32; i < 40; i++) {
-    message[i] = scratchpad[i - 32];
-  }
+  memcpy(&message[32], scratchpad, 8);
 
   // Memory page number.
   // 	message[40] bit 7:4 = 0000 for Copy Scratchpad
@@ -347,48 +1182,647 @@ static void generate_mac(const u8 *secret, const u8 *scratchpad,
   // message[40] = ((memory_page & 0x01e0) >> 5) & 0x0f;
   message[40] = ((memory_page & 0xf0) >> 5);
 
-  // message[41] is family_code, which is conveniently the first byte of the
-  // serial_number.
-  for (i = 41; i < 48; i++) {
-    message[i] = serial_number[i - 41];
-  }
+  maxim_sha_transform(sha1, message);
 
-  // Second half of the secret.
-  for (i = 48; i < 52; i++) {
-    message[i] = secret[i - 44];
-  }
+  memzero_explicit(message, sizeof(message));
+}
 
-  // Magic numbers taken from the datasheet.
-  message[52] = 0xff;
-  message[53] = 0xff;
-  message[54] = 0xff;
-  message[55] = 0x80;
+/**
+ * Generate MAC for copy scratchpad operation
+ *
+ * secret: 8 bytes, actual secret
+ * scratchpad: 8 bytes, scratchpad data
+ * memory_page: page number (1 to 3 inclusive) or 0 for scratchpad
+ * data_memory_page: the first 28 bytes of the addressed memory page
+ * serial_number: device serial_number
+ * sha1: generated MAC
+ */
+static void generate_mac(const u8 *secret, const u8 *scratchpad,
+                         u16 memory_page, const u8 *data_memory_page,
+                         const u8 *serial_number, struct sha1 *sha1,
+                         struct w1_slave *sl) {
+  u8 template[64];
+
+  prepare_mac_template(secret, serial_number, template);
+  generate_mac_from_template(template, scratchpad, memory_page,
+                             data_memory_page, sha1);
+
+  memzero_explicit(template, sizeof(template));
+}
+
+// Serialize a MAC in the order the DS2432 sends and expects it: E, D, C, B
+// then A, each least significant byte first.
+static void w1_ds2432_mac_to_bytes(const struct sha1 *mac, u8 *bytes) {
+  const u32 words[5] = {mac->e, mac->d, mac->c, mac->b, mac->a};
+  u32 i;
+
+  for (i = 0; i < ARRAY_SIZE(words); i++) {
+    put_unaligned_le32(words[i], &bytes[4 * i]);
+  }
+}
+
+// Install a new secret. The caller must hold the bus_mutex.
+static void w1_b3_set_secret(struct w1_b3_data *b3_data, const u8 *secret,
+                             enum w1_ds2432_secret_source source) {
+  if (secret) {
+    memcpy(b3_data->secret, secret, sizeof(b3_data->secret));
+  } else {
+    memzero_explicit(b3_data->secret, sizeof(b3_data->secret));
+  }
+  b3_data->secret_source = source;
+  b3_data->mac_template_valid = false;
+  b3_data->auth_valid = false;
+}
+
+// Release the keyring key backing the secret, if any.
+static void w1_b3_drop_key(struct w1_b3_data *b3_data) {
+  key_put(b3_data->secret_key);
+  b3_data->secret_key = NULL;
+  b3_data->secret_key_stale = false;
+  kfree(b3_data->secret_key_desc);
+  b3_data->secret_key_desc = NULL;
+}
+
+/**
+ * Generate the MAC for a Read Authenticated Page operation
+ *
+ * secret: 8 bytes, actual secret
+ * challenge: 3 bytes, scratchpad bytes 4 to 6 at the time of the read
+ * page: page number (0 to 3)
+ * data_memory_page: the 32 bytes of the page
+ * serial_number: device serial_number
+ * sha1: generated MAC
+ *
+ * Unlike Copy Scratchpad, the whole page is hashed, followed by 4 bytes of FFh.
+ */
+static void generate_auth_mac(const u8 *secret, const u8 *challenge, u8 page,
+                              const u8 *data_memory_page,
+                              const u8 *serial_number, struct sha1 *sha1) {
+  u8 message[64] = {0};
+
+  memcpy(&message[0], &secret[0], 4);
+  memcpy(&message[4], data_memory_page, 32);
+  memset(&message[36], 0xff, 4);
 
-  message[56] = 0x00;
-  message[57] = 0x00;
-  message[58] = 0x00;
-  message[59] = 0x00;
+  // message[40] bit 7:4 = 0100 for Read Authenticated Page
+  // message[40] bit 3:0 = T8:T5
+  message[40] = 0x40 | (page & 0x03);
 
-  message[60] = 0x00;
-  message[61] = 0x00;
+  memcpy(&message[41], serial_number, 7);
+  memcpy(&message[48], &secret[4], 4);
+  memcpy(&message[52], challenge, 3);
+
+  message[55] = 0x80;
   message[62] = 0x01;
   message[63] = 0xb8;
 
   maxim_sha_transform(sha1, message);
+
+  memzero_explicit(message, sizeof(message));
+}
+
+/**
+ * Read a whole data page with Read Authenticated Page
+ *
+ * page: page number (0 to 3)
+ * challenge: 3 bytes, loaded in the scratchpad before the read
+ * data: 32 bytes, page content
+ * mac: 20 bytes, MAC computed by the DS2432, in bus order
+ *
+ * Both the page and the MAC are protected by a CRC16 which is always checked.
+ * With a NULL `challenge` and `mac` the read stops right after the page CRC,
+ * which makes it a cheap CRC-protected page read.
+ *
+ * The caller must hold the bus_mutex.
+ */
+static int w1_ds2432_read_authenticated_page(struct w1_slave *sl, u8 page,
+                                             const u8 *challenge, u8 *data,
+                                             u8 *mac) {
+  u16 address = page * W1_DS2432_PAGE_SIZE;
+  u8 scratchpad[8];
+  u8 wrbuf[3];
+  u8 rdbuf[3];
+  u8 success;
+  u16 crc;
+  u64 start_ns;
+  int error = 0;
+
+  // 1. The challenge is taken from scratchpad bytes 4 to 6.
+  if (mac) {
+    memset(scratchpad, 0xff, sizeof(scratchpad));
+    memcpy(&scratchpad[4], challenge, 3);
+
+    error = w1_ds2432_write_scratchpad(sl, address, scratchpad);
+    if (error < 0) {
+      return error;
+    }
+  }
+
+  start_ns = ktime_get_ns();
+
+  if (w1_ds2432_reset_select(sl) < 0) {
+    w1_ds2432_trace(sl, DS2432_READ_AUTHENTICATED, address, 0, start_ns,
+                    -ENODEV);
+    return -ENODEV;
+  }
+
+  // 2. Command and target address, then the page, an FFh byte and the
+  // inverted CRC16 of all of them.
+  wrbuf[0] = DS2432_READ_AUTHENTICATED;
+  wrbuf[1] = (u8)(address & 0xff);
+  wrbuf[2] = (u8)(address >> 8);
+
+  w1_write_block(sl->master, wrbuf, sizeof(wrbuf));
+  w1_read_block(sl->master, data, W1_DS2432_PAGE_SIZE);
+  w1_read_block(sl->master, rdbuf, sizeof(rdbuf));
+
+  crc = crc16(CRC16_INIT, wrbuf, sizeof(wrbuf));
+  crc = crc16(crc, data, W1_DS2432_PAGE_SIZE);
+  crc = crc16(crc, rdbuf, sizeof(rdbuf));
+  if (crc != CRC16_VALID) {
+    dev_err(&sl->dev, "read_authenticated_page: invalid page %u checksum\n",
+            page);
+    w1_b3_link_error(sl, W1_DS2432_LINK_CRC);
+    error = -EIO;
+    goto out;
+  }
+
+  if (!mac) {
+    // Nothing more needed, the reset of the next command aborts the MAC.
+    goto out;
+  }
+
+  // 3. Let enough time to the DS2432 to compute the SHA1, then read the MAC
+  // and its inverted CRC16.
+  msleep(2 + w1_b3_link_policy(sl)->margin_ms);
+
+  w1_read_block(sl->master, mac, 20);
+  w1_read_block(sl->master, rdbuf, 2);
+
+  crc = crc16(CRC16_INIT, mac, 20);
+  crc = crc16(crc, rdbuf, 2);
+  if (crc != CRC16_VALID) {
+    dev_err(&sl->dev, "read_authenticated_page: invalid mac checksum\n");
+    w1_b3_link_error(sl, W1_DS2432_LINK_CRC);
+    error = -EIO;
+    goto out;
+  }
+
+  // 4. A pattern of alternating 1s and 0s tells the MAC computation
+  // completed.
+  success = w1_read_8(sl->master);
+  if (success != 0xAA && success != 0x55) {
+    dev_err(&sl->dev, "unable to read_authenticated_page: code %02x\n",
+            success);
+    w1_b3_link_error(sl, W1_DS2432_LINK_STATUS);
+    error = -EIO;
+  }
+
+out:
+  w1_ds2432_trace(sl, DS2432_READ_AUTHENTICATED, address, W1_DS2432_PAGE_SIZE,
+                  start_ns, error);
+
+  return error;
+}
+
+/**
+ * Authenticate a page against a secret
+ *
+ * Reads the page with a fresh random challenge and compares the MAC from the
+ * DS2432 with the one computed using `secret`. Returns 0 when they match,
+ * -EACCES when they do not (wrong secret or not genuine) and another negative
+ * errno on bus errors. `data` (32 bytes, may be NULL) receives the page.
+ *
+ * The caller must hold the bus_mutex.
+ */
+static int w1_ds2432_authenticate_page(struct w1_slave *sl, const u8 *secret,
+                                       u8 page, u8 *data) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  u8 page_data[W1_DS2432_PAGE_SIZE];
+  u8 device_mac[20];
+  u8 host_mac[20];
+  u8 challenge[3];
+  struct sha1 mac;
+  int error;
+
+  get_random_bytes(challenge, sizeof(challenge));
+
+  error = w1_ds2432_read_authenticated_page(sl, page, challenge, page_data,
+                                            device_mac);
+  if (error < 0) {
+    return error;
+  }
+
+  generate_auth_mac(secret, challenge, page, page_data,
+                    b3_data->registration_number, &mac);
+  w1_ds2432_mac_to_bytes(&mac, host_mac);
+
+  if (data) {
+    memcpy(data, page_data, sizeof(page_data));
+  }
+
+  // EACCES: mac is invalid, wrong secret or device not genuine.
+  return memcmp(host_mac, device_mac, sizeof(host_mac)) ? -EACCES : 0;
+}
+
+/**
+ * Pick this slave's secret from the secret table
+ *
+ * Every entry matching the registration number prefix or the manufacturer ID
+ * is a candidate, and the first one confirmed by an authenticated read of
+ * page 0 wins. Returns -ENOENT when nothing matches or confirms, another
+ * negative error when the bus did not let the candidates be checked; the
+ * secret is then left as it is.
+ *
+ * The caller must hold the bus_mutex.
+ */
+static int w1_ds2432_secret_table_resolve(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  u8 candidates[W1_DS2432_SECRET_TABLE_SIZE][8];
+  unsigned int count = 0;
+  unsigned int i;
+  bool need_manufacturer_id = false;
+  u8 manufacturer_id[2];
+  int error = -ENOENT;
+
+  mutex_lock(&w1_ds2432_secret_table_lock);
+  for (i = 0; i < w1_ds2432_secret_table_len; i++) {
+    need_manufacturer_id |= w1_ds2432_secret_table[i].manufacturer_id;
+  }
+  mutex_unlock(&w1_ds2432_secret_table_lock);
+
+  // The manufacturer ID costs one short read, and only when an entry needs it.
+  if (need_manufacturer_id) {
+    error = w1_ds2432_read_memory(sl, W1_DS2432_REGISTER_PAGE_ADDR + 6,
+                                  manufacturer_id, sizeof(manufacturer_id));
+    if (error < 0) {
+      return error;
+    }
+    error = -ENOENT;
+  }
+
+  mutex_lock(&w1_ds2432_secret_table_lock);
+  for (i = 0; i < w1_ds2432_secret_table_len; i++) {
+    const struct w1_ds2432_secret_entry *entry = &w1_ds2432_secret_table[i];
+    const u8 *id = b3_data->registration_number;
+
+    if (entry->manufacturer_id) {
+      id = manufacturer_id;
+    }
+
+    if (!memcmp(entry->match, id, entry->match_len)) {
+      memcpy(candidates[count++], entry->secret, 8);
+    }
+  }
+  mutex_unlock(&w1_ds2432_secret_table_lock);
+
+  for (i = 0; i < count; i++) {
+    error = w1_ds2432_authenticate_page(sl, candidates[i], 0, NULL);
+    if (error == -EACCES) {
+      continue;
+    }
+
+    // A bus error does not tell anything about the secret; the match is
+    // tried again on next use.
+    if (error < 0) {
+      dev_warn(&sl->dev, "unable to confirm secret table entry (%d)\n",
+               error);
+      break;
+    }
+
+    w1_b3_set_secret(b3_data, candidates[i], W1_DS2432_SECRET_TABLE);
+    break;
+  }
+
+  if (count && error == -EACCES) {
+    dev_warn(&sl->dev, "no secret table entry authenticates this device\n");
+    error = -ENOENT;
+  }
+
+  memzero_explicit(candidates, sizeof(candidates));
+
+  return error;
+}
+
+/**
+ * Derive a device secret from the master key
+ *
+ * The secret is the first 8 bytes of the Maxim SHA-1 MAC computed with the
+ * master key as secret, over the registration number (in place of the
+ * scratchpad) and a blank memory page. This is the primitive the DS2432 itself
+ * uses, so no other hash implementation is needed.
+ */
+static void w1_ds2432_derive_secret(const u8 *master_key,
+                                    const u8 *registration_number,
+                                    u8 *secret) {
+  u8 blank_page[28];
+  u8 mac_bytes[20];
+  struct sha1 mac;
+
+  memset(blank_page, 0xff, sizeof(blank_page));
+
+  generate_mac(master_key, registration_number, 0, blank_page,
+               registration_number, &mac, NULL);
+  w1_ds2432_mac_to_bytes(&mac, mac_bytes);
+
+  memcpy(secret, mac_bytes, 8);
+
+  memzero_explicit(mac_bytes, sizeof(mac_bytes));
+  memzero_explicit(&mac, sizeof(mac));
+}
+
+/**
+ * Compute the secret the DS2432 installs on Compute Next Secret
+ *
+ * The device runs its SHA-1 over the current secret, the whole target page
+ * (M[4..35]) and the scratchpad (M[36..43]), with FFh in place of the page
+ * code, serial number and challenge, and keeps the first 8 bytes of the
+ * result.
+ *
+ * secret: 8 bytes, current secret
+ * page_data: 32 bytes, target page
+ * partial: 8 bytes, scratchpad content
+ * next: 8 bytes, new secret
+ */
+static void w1_ds2432_next_secret(const u8 *secret, const u8 *page_data,
+                                  const u8 *partial, u8 *next) {
+  u8 message[64] = {0};
+  u8 mac_bytes[20];
+  struct sha1 mac;
+
+  memcpy(&message[0], &secret[0], 4);
+  memcpy(&message[4], page_data, 32);
+  memcpy(&message[36], partial, 8);
+  memset(&message[44], 0xff, 4);
+  memcpy(&message[48], &secret[4], 4);
+  memset(&message[52], 0xff, 3);
+
+  message[55] = 0x80;
+  message[62] = 0x01;
+  message[63] = 0xb8;
+
+  maxim_sha_transform(&mac, message);
+  w1_ds2432_mac_to_bytes(&mac, mac_bytes);
+
+  memcpy(next, mac_bytes, 8);
+
+  memzero_explicit(message, sizeof(message));
+  memzero_explicit(mac_bytes, sizeof(mac_bytes));
+  memzero_explicit(&mac, sizeof(mac));
+}
+
+// Look a secret key up in the keyrings: a "logon" key (whose payload can not
+// be read back from userspace) or a "user" key with an 8-byte payload.
+static struct key *w1_ds2432_request_key(const char *description) {
+  struct key *key;
+
+  key = request_key(&key_type_logon, description, NULL);
+  if (IS_ERR(key)) {
+    key = request_key(&key_type_user, description, NULL);
+  }
+
+  return key;
+}
+
+/**
+ * Copy the secret out of the slave's key when its payload differs from the
+ * secret in use. The content is compared rather than the payload pointer,
+ * which a later update may reuse. When the key was revoked or expired, the
+ * slave is left without a secret and key_work looks it up again by
+ * description, since that may call out to userspace.
+ *
+ * The caller must hold the bus_mutex.
+ */
+static void w1_b3_refresh_key(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  const struct user_key_payload *payload;
+  u8 secret[8] = {0};
+  struct key *key = b3_data->secret_key;
+  bool valid;
+
+  if (b3_data->secret_key_stale) {
+    return;
+  }
+
+  if (key_validate(key) < 0) {
+    b3_data->secret_key_stale = true;
+    w1_b3_set_secret(b3_data, NULL, W1_DS2432_SECRET_KEY);
+    queue_work(w1_ds2432_wq, &b3_data->key_work);
+    return;
+  }
+
+  down_read(&key->sem);
+  payload = user_key_payload_locked(key);
+  valid = payload && payload->datalen == sizeof(secret);
+  if (valid) {
+    memcpy(secret, payload->data, sizeof(secret));
+  }
+  up_read(&key->sem);
+
+  if (memcmp(secret, b3_data->secret, sizeof(secret))) {
+    if (!valid) {
+      dev_warn(&sl->dev, "secret key \"%s\" is not 8 bytes long\n",
+               b3_data->secret_key_desc);
+    }
+    w1_b3_set_secret(b3_data, secret, W1_DS2432_SECRET_KEY);
+  }
+
+  memzero_explicit(secret, sizeof(secret));
+}
+
+// Look a revoked or expired key up again by description, outside the
+// bus_mutex. Gives up on the key if it is gone for good.
+static void w1_b3_key_work(struct work_struct *work) {
+  struct w1_b3_data *b3_data =
+      container_of(work, struct w1_b3_data, key_work);
+  struct w1_slave *sl = b3_data->sl;
+  struct key *key;
+  char *desc = NULL;
+
+  w1_b3_lock(sl);
+  if (b3_data->secret_key_stale) {
+    desc = kstrdup(b3_data->secret_key_desc, GFP_KERNEL);
+  }
+  w1_b3_unlock(sl);
+
+  if (!desc) {
+    return;
+  }
+
+  key = w1_ds2432_request_key(desc);
+
+  w1_b3_lock(sl);
+  // The key may have been replaced or forgotten meanwhile.
+  if (b3_data->secret_key_stale && !strcmp(desc, b3_data->secret_key_desc)) {
+    if (IS_ERR(key)) {
+      dev_warn(&sl->dev, "secret key \"%s\" is gone (%ld)\n", desc,
+               PTR_ERR(key));
+      w1_b3_drop_key(b3_data);
+      w1_b3_set_secret(b3_data, NULL, W1_DS2432_SECRET_DEFAULT);
+    } else {
+      key_put(b3_data->secret_key);
+      b3_data->secret_key = key;
+      b3_data->secret_key_stale = false;
+      key = NULL;
+      w1_b3_refresh_key(sl);
+    }
+  }
+  w1_b3_unlock(sl);
+
+  if (!IS_ERR_OR_NULL(key)) {
+    key_put(key);
+  }
+  kfree(desc);
+}
+
+/**
+ * Return the secret to use with this slave.
+ *
+ * A secret written through the secret attribute, installed by a rotation job
+ * or given as a keyring key always wins; the key is only checked for
+ * revocation or update, and looked up again in the background. Otherwise the
+ * secret table is (re)matched when it changed, which may take an
+ * authenticated read, and failing that the secret is (re)derived from the
+ * master key the first time it is needed after the master key changed.
+ *
+ * The caller must hold the bus_mutex, and must not be in the middle of a
+ * scratchpad sequence since matching the table uses the scratchpad.
+ */
+static const u8 *w1_b3_secret(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  unsigned int table_gen;
+  int error;
+
+  if (b3_data->secret_source == W1_DS2432_SECRET_USER ||
+      b3_data->secret_source == W1_DS2432_SECRET_ROTATED) {
+    return b3_data->secret;
+  }
+
+  if (b3_data->secret_source == W1_DS2432_SECRET_KEY) {
+    w1_b3_refresh_key(sl);
+    if (b3_data->secret_source == W1_DS2432_SECRET_KEY) {
+      return b3_data->secret;
+    }
+  }
+
+  mutex_lock(&w1_ds2432_secret_table_lock);
+  table_gen = w1_ds2432_secret_table_gen;
+  mutex_unlock(&w1_ds2432_secret_table_lock);
+
+  if (table_gen != b3_data->secret_table_gen) {
+    error = w1_ds2432_secret_table_resolve(sl);
+
+    if (error == 0) {
+      b3_data->secret_table_gen = table_gen;
+      return b3_data->secret;
+    }
+
+    // Only a settled outcome is remembered; after a bus error the table is
+    // matched again next time, and the secret stays as it was meanwhile.
+    if (error == -ENOENT) {
+      b3_data->secret_table_gen = table_gen;
+
+      if (b3_data->secret_source == W1_DS2432_SECRET_TABLE) {
+        // The entry went away, fall back to the master key (or no secret).
+        w1_b3_set_secret(b3_data, NULL, W1_DS2432_SECRET_DEFAULT);
+        b3_data->secret_gen = 0;
+      }
+    }
+  }
+
+  if (b3_data->secret_source == W1_DS2432_SECRET_TABLE) {
+    return b3_data->secret;
+  }
+
+  mutex_lock(&w1_ds2432_master_key_lock);
+  if (w1_ds2432_master_key_gen &&
+      w1_ds2432_master_key_gen != b3_data->secret_gen) {
+    u8 secret[8];
+
+    w1_ds2432_derive_secret(w1_ds2432_master_key,
+                            b3_data->registration_number, secret);
+    w1_b3_set_secret(b3_data, secret, W1_DS2432_SECRET_DERIVED);
+    b3_data->secret_gen = w1_ds2432_master_key_gen;
+    memzero_explicit(secret, sizeof(secret));
+  } else if (!w1_ds2432_master_key_gen &&
+             b3_data->secret_source == W1_DS2432_SECRET_DERIVED) {
+    // The master key was cleared, so forget the secret derived from it.
+    w1_b3_set_secret(b3_data, NULL, W1_DS2432_SECRET_DEFAULT);
+    b3_data->secret_gen = 0;
+  }
+  mutex_unlock(&w1_ds2432_master_key_lock);
+
+  return b3_data->secret;
+}
+
+/**
+ * Return the copy scratchpad MAC template for this slave's current secret,
+ * preparing it only when the secret changed.
+ *
+ * Same constraints as w1_b3_secret().
+ */
+static const u8 *w1_b3_mac_template(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  const u8 *secret = w1_b3_secret(sl);
+
+  if (!b3_data->mac_template_valid) {
+    prepare_mac_template(secret, b3_data->registration_number,
+                         b3_data->mac_template);
+    b3_data->mac_template_valid = true;
+  }
+
+  return b3_data->mac_template;
+}
+
+/**
+ * Tell whether this slave is genuine, i.e. knows its secret.
+ *
+ * Returns 0 when genuine, -EACCES when not and another negative errno when the
+ * device could not be asked. Verdicts are served from cache for auth_ttl_ms
+ * and re-established with an authenticated read of page 0 afterwards.
+ *
+ * The caller must hold the bus_mutex.
+ */
+static int w1_b3_authenticate(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  unsigned int ttl = READ_ONCE(auth_ttl_ms);
+  const u8 *secret;
+  int error;
+
+  // Settle the secret first: a new one drops the cached verdict.
+  secret = w1_b3_secret(sl);
+
+  if (b3_data->auth_valid && ttl &&
+      time_before(jiffies, b3_data->auth_stamp + msecs_to_jiffies(ttl))) {
+    return b3_data->auth_verdict;
+  }
+
+  error = w1_ds2432_authenticate_page(sl, secret, 0, NULL);
+  if (error == 0 || error == -EACCES) {
+    b3_data->auth_valid = true;
+    b3_data->auth_verdict = error;
+    b3_data->auth_stamp = jiffies;
+  }
+
+  return error;
 }
 
 static int w1_ds2432_copy_scratchpad(struct w1_slave *sl, u16 address, u8 es,
                                      const struct sha1 *mac) {
   u8 copy_scratchpad[4] = {0};
   u8 copy_scratchpad_mac[20] = {0};
-  u32 value = 0;
-  u32 i = 0;
   u8 success = 0;
+  u64 start_ns = ktime_get_ns();
+  int error = 0;
 
-  if (w1_reset_select_slave(sl)) {
-    return -EIO;
+  if (w1_ds2432_reset_select(sl) < 0) {
+    w1_ds2432_trace(sl, DS2432_COPY_SCRATCHPAD, address, 0, start_ns, -ENODEV);
+    return -ENODEV;
   }
 
+  // Whatever the outcome, the device content may change.
+  w1_b3_invalidate_verdict(sl);
+
   // Copy scratchpad command
   copy_scratchpad[0] = DS2432_COPY_SCRATCHPAD;
   copy_scratchpad[1] = (u8)(address & 0xff);
@@ -398,37 +1832,9 @@ static int w1_ds2432_copy_scratchpad(struct w1_slave *sl, u16 address, u8 es,
   w1_write_block(sl->master, copy_scratchpad, 4);
 
   // Let enough time to the DS2432 to compute the SHA1.
-  msleep(2);
-
-  value = mac->e;
-  for (i = 0; i < 4; i++) {
-    copy_scratchpad_mac[i] = (u8)(value & 0xff);
-    value = value >> 8;
-  }
-
-  value = mac->d;
-  for (i = 0; i < 4; i++) {
-    copy_scratchpad_mac[4 + i] = (u8)(value & 0xff);
-    value = value >> 8;
-  }
+  msleep(2 + w1_b3_link_policy(sl)->margin_ms);
 
-  value = mac->c;
-  for (i = 0; i < 4; i++) {
-    copy_scratchpad_mac[8 + i] = (u8)(value & 0xff);
-    value = value >> 8;
-  }
-
-  value = mac->b;
-  for (i = 0; i < 4; i++) {
-    copy_scratchpad_mac[12 + i] = (u8)(value & 0xff);
-    value = value >> 8;
-  }
-
-  value = mac->a;
-  for (i = 0; i < 4; i++) {
-    copy_scratchpad_mac[16 + i] = (u8)(value & 0xff);
-    value = value >> 8;
-  }
+  w1_ds2432_mac_to_bytes(mac, copy_scratchpad_mac);
 
   w1_write_block(sl->master, copy_scratchpad_mac, 20);
 
@@ -441,7 +1847,7 @@ static int w1_ds2432_copy_scratchpad(struct w1_slave *sl, u16 address, u8 es,
   // Reset Pulse. A pattern of all zeros tells the master that the copy did not
   // take place.
 
-  msleep(10);
+  msleep(10 + w1_b3_link_policy(sl)->margin_ms);
 
   // As indication for a successful copy the master will be
   // able to read a pattern of alternating 1s ands until it issues a Reset
@@ -452,24 +1858,23 @@ static int w1_ds2432_copy_scratchpad(struct w1_slave *sl, u16 address, u8 es,
     dev_err(&sl->dev, "unable to copy_scratchpad: invalid mac (code %02x)",
             success);
     // EACCES: mac is invalid, probably due to a bad key.
-    return -EACCES;
-  }
-
-  if (success == 0xff) {
+    error = -EACCES;
+  } else if (success == 0xff) {
     dev_err(&sl->dev, "unable to copy_scratchpad: write protected (code %02x)",
             success);
     // EPERM: mac is valid but the chip is write protected.
-    return -EPERM;
-  }
-
-  if (success != 0xAA && success != 0x55) {
+    error = -EPERM;
+  } else if (success != 0xAA && success != 0x55) {
     dev_err(&sl->dev, "unable to copy_scratchpad: unknown error (code %02x)",
             success);
+    w1_b3_link_error(sl, W1_DS2432_LINK_STATUS);
     // EIO: unknown error, potentially i/o related.
-    return -EIO;
+    error = -EIO;
   }
 
-  return 0;
+  w1_ds2432_trace(sl, DS2432_COPY_SCRATCHPAD, address, 0, start_ns, error);
+
+  return error;
 }
 
 static int w1_ds2432_write_secret(struct w1_slave *sl, u8 *secret) {
@@ -478,9 +1883,9 @@ static int w1_ds2432_write_secret(struct w1_slave *sl, u8 *secret) {
   u8 es = 0;
   u8 data[8] = {0};
 
-  if (w1_reset_select_slave(sl)) {
-    // EIO: unable to select device.
-    return -EIO;
+  if (w1_ds2432_reset_select(sl) < 0) {
+    // ENODEV: the device is gone.
+    return -ENODEV;
   }
 
   // 1. Send a WRITE_SCRATCHPAD command to the buffer where the secret is
@@ -499,12 +1904,14 @@ static int w1_ds2432_write_secret(struct w1_slave *sl, u8 *secret) {
   if (address != W1_DS2432_SECRET_ADDR) {
     dev_err(&sl->dev, "unexpected address: %04x (expected %04x)\n", address,
             W1_DS2432_SECRET_ADDR);
+    w1_b3_link_error(sl, W1_DS2432_LINK_CRC);
     // EIO: invalid address, probably due to i/o.
     return -EIO;
   }
 
   if ((es >> 5) & 1) {
     dev_err(&sl->dev, "ES partial byte is 1\n");
+    w1_b3_link_error(sl, W1_DS2432_LINK_STATUS);
     // EIO: invalid ES byte, probably due to i/o.
     return -EIO;
   }
@@ -520,49 +1927,507 @@ static int w1_ds2432_write_secret(struct w1_slave *sl, u8 *secret) {
   return error;
 }
 
-//
-// eeprom (page 0 to 3)
-//
+/**
+ * Replace the secret with one computed by the device from the current secret,
+ * a page and a partial secret, see w1_ds2432_next_secret().
+ *
+ * page: page number (0 to 3)
+ * partial: 8 bytes, loaded in the scratchpad first
+ *
+ * The caller must hold the bus_mutex.
+ */
+static int w1_ds2432_compute_next_secret(struct w1_slave *sl, u8 page,
+                                         const u8 *partial) {
+  u16 address = page * W1_DS2432_PAGE_SIZE;
+  u8 wrbuf[3];
+  u8 success;
+  u64 start_ns;
+  int error;
 
-static ssize_t eeprom_read(struct file *filp, struct kobject *kobj,
-                           struct bin_attribute *bin_attr, char *buf,
-                           loff_t off, size_t count) {
-  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  error = w1_ds2432_write_scratchpad(sl, address, partial);
+  if (error < 0) {
+    return error;
+  }
+
+  start_ns = ktime_get_ns();
+
+  if (w1_ds2432_reset_select(sl) < 0) {
+    w1_ds2432_trace(sl, DS2432_COMPUTE_NEXT_SECRET, address, 0, start_ns,
+                    -ENODEV);
+    return -ENODEV;
+  }
+
+  w1_b3_invalidate_verdict(sl);
+
+  wrbuf[0] = DS2432_COMPUTE_NEXT_SECRET;
+  wrbuf[1] = (u8)(address & 0xff);
+  wrbuf[2] = (u8)(address >> 8);
+
+  w1_write_block(sl->master, wrbuf, sizeof(wrbuf));
+
+  // SHA-1 computation, then programming of the secret, during which the
+  // voltage on the 1-Wire bus must not fall below 2.8V.
+  msleep(2 + 10 + w1_b3_link_policy(sl)->margin_ms);
+
+  success = w1_read_8(sl->master);
+
+  if (success != 0xAA && success != 0x55) {
+    dev_err(&sl->dev, "unable to compute_next_secret, code %02x\n", success);
+    w1_b3_link_error(sl, W1_DS2432_LINK_STATUS);
+    error = -EIO;
+  }
+
+  w1_ds2432_trace(sl, DS2432_COMPUTE_NEXT_SECRET, address, 0, start_ns, error);
+
+  w1_reset_bus(sl->master);
+
+  return error;
+}
+
+//
+// eeprom (page 0 to 3)
+//
+
+/**
+ * Read [off, off + count) one page at a time with Read Authenticated Page.
+ *
+ * Every page comes with a CRC16, and with `check_mac` its MAC is verified
+ * against the secret too. A page failing its checks is read again, as many
+ * times as the link policy allows, without touching the pages already read.
+ *
+ * The caller must hold the bus_mutex.
+ */
+static int w1_ds2432_read_memory_checked(struct w1_slave *sl, loff_t off,
+                                         u8 *buf, size_t count,
+                                         bool check_mac) {
+  u8 page_data[W1_DS2432_PAGE_SIZE];
+  unsigned int retries = w1_b3_link_policy(sl)->read_retries;
+  const u8 *secret = NULL;
+  size_t done = 0;
+  int error = 0;
+
+  if (check_mac) {
+    secret = w1_b3_secret(sl);
+  }
+
+  while (done < count) {
+    u8 page = (off + done) / W1_DS2432_PAGE_SIZE;
+    size_t skip = (off + done) % W1_DS2432_PAGE_SIZE;
+    size_t chunk = min(W1_DS2432_PAGE_SIZE - skip, count - done);
+    int attempt;
+
+    for (attempt = 0; attempt < retries; attempt++) {
+      if (check_mac) {
+        error = w1_ds2432_authenticate_page(sl, secret, page, page_data);
+      } else {
+        error = w1_ds2432_read_authenticated_page(sl, page, NULL, page_data,
+                                                  NULL);
+      }
+
+      // Only transfer errors are worth another try; a MAC mismatch is not
+      // going to fix itself.
+      if (error != -EIO) {
+        break;
+      }
+    }
+
+    if (error < 0) {
+      return error;
+    }
+
+    memcpy(buf + done, page_data + skip, chunk);
+    done += chunk;
+  }
+
+  return 0;
+}
+
+//
+// Error correcting code
+//
+// Hamming SECDED over the first 30 bytes of a page (240 data bits). Data bit n
+// sits at the (n + 1)th position that is not a power of two, the check bits at
+// the powers of two: byte 30 holds the XOR of the positions of the set data
+// bits, bit 0 of byte 31 the parity of everything else.
+#define W1_DS2432_ECC_DATA_SIZE         30
+
+static u8 w1_ds2432_ecc_syndrome(const u8 *data, u8 *parity) {
+  unsigned int position = 2;
+  u8 syndrome = 0;
+  u8 ones = 0;
+  int bit;
+
+  for (bit = 0; bit < W1_DS2432_ECC_DATA_SIZE * 8; bit++) {
+    do {
+      position++;
+    } while (is_power_of_2(position));
+
+    if (data[bit / 8] & BIT(bit % 8)) {
+      syndrome ^= position;
+      ones ^= 1;
+    }
+  }
+
+  *parity = ones;
+
+  return syndrome;
+}
+
+// Whether [offset, offset + length) of the data memory covers check bytes.
+static bool w1_ds2432_ecc_overlaps(unsigned int offset, unsigned int length) {
+  unsigned int end = offset + length;
+  unsigned int page;
+
+  for (page = offset / W1_DS2432_PAGE_SIZE;
+       page * W1_DS2432_PAGE_SIZE < end; page++) {
+    if (end > page * W1_DS2432_PAGE_SIZE + W1_DS2432_ECC_DATA_SIZE) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Fill in the check bytes of a page.
+static void w1_ds2432_ecc_encode(u8 *page) {
+  u8 parity;
 
-  if ((count = w1_b3_fix_count(off, count, W1_DS2432_DATA_MEMORY_SIZE)) == 0) {
+  page[W1_DS2432_ECC_DATA_SIZE] = w1_ds2432_ecc_syndrome(page, &parity);
+  page[W1_DS2432_ECC_DATA_SIZE + 1] =
+      parity ^ (hweight8(page[W1_DS2432_ECC_DATA_SIZE]) & 1);
+}
+
+/**
+ * Check a page against its check bytes, fixing a single flipped bit in place.
+ *
+ * Returns 0 when the page is intact, 1 when a bit was corrected, -EBADMSG
+ * when two or more bits are wrong.
+ */
+static int w1_ds2432_ecc_correct(u8 *page) {
+  u8 *check = &page[W1_DS2432_ECC_DATA_SIZE];
+  u8 syndrome;
+  u8 parity;
+  unsigned int bit;
+
+  syndrome = w1_ds2432_ecc_syndrome(page, &parity) ^ check[0];
+  parity ^= (hweight8(check[0]) ^ check[1]) & 1;
+
+  if (!parity) {
+    // Even number of flips: none, or too many to locate.
+    return syndrome ? -EBADMSG : 0;
+  }
+
+  if (syndrome == 0) {
+    check[1] ^= 1;
+  } else if (is_power_of_2(syndrome)) {
+    check[0] ^= syndrome;
+  } else {
+    // Non-powers of two up to the syndrome, minus the syndrome itself.
+    bit = syndrome - fls(syndrome) - 1;
+    if (bit >= W1_DS2432_ECC_DATA_SIZE * 8) {
+      return -EBADMSG;
+    }
+    page[bit / 8] ^= BIT(bit % 8);
+  }
+
+  return 1;
+}
+
+// Read mode in effect: a poor link gets checked reads even when the slave asks
+// for plain ones. The caller must hold the bus_mutex.
+static enum w1_ds2432_read_mode w1_b3_read_mode(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+
+  return max(b3_data->read_mode, w1_b3_link_policy(sl)->read_mode);
+}
+
+// Read pages [first, last] into `dest`, as the slave's read mode and link
+// policy say. The caller must hold the bus_mutex.
+static int w1_b3_read_pages(struct w1_slave *sl, u8 first, u8 last, u8 *dest) {
+  size_t len = (last - first + 1) * W1_DS2432_PAGE_SIZE;
+  enum w1_ds2432_read_mode mode = w1_b3_read_mode(sl);
+
+  if (mode == W1_DS2432_READ_PLAIN) {
+    return w1_ds2432_read_memory(sl, first * W1_DS2432_PAGE_SIZE, dest, len);
+  }
+
+  return w1_ds2432_read_memory_checked(sl, first * W1_DS2432_PAGE_SIZE, dest,
+                                       len, mode == W1_DS2432_READ_MAC);
+}
+
+/**
+ * Check a freshly read page of the cache against its code. A single bit error
+ * is corrected in place; otherwise the page is read again, as many times as
+ * the link policy allows.
+ *
+ * Returns 0, -EBADMSG when the page stays uncorrectable, or a bus error. The
+ * caller must hold the bus_mutex.
+ */
+static int w1_b3_ecc_check(struct w1_slave *sl, u8 page) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  u8 *data = &b3_data->image[page * W1_DS2432_PAGE_SIZE];
+  unsigned int retries = w1_b3_link_policy(sl)->read_retries;
+  unsigned int attempt;
+  int error;
+
+  for (attempt = 0;; attempt++) {
+    error = w1_ds2432_ecc_correct(data);
+    if (error > 0) {
+      b3_data->ecc_corrected++;
+    }
+    if (error >= 0) {
+      return 0;
+    }
+
+    if (attempt == retries) {
+      break;
+    }
+
+    b3_data->ecc_rereads++;
+    error = w1_b3_read_pages(sl, page, page, data);
+    if (error < 0) {
+      return error;
+    }
+  }
+
+  b3_data->ecc_failed++;
+  dev_dbg(&sl->dev, "page %u: uncorrectable\n", page);
+
+  return -EBADMSG;
+}
+
+// Read pages [first, last] from the device into the cache, as the slave's
+// read mode says, in as few commands as possible. The caller must hold the
+// bus_mutex.
+static int w1_b3_fill_pages(struct w1_slave *sl, u8 first, u8 last) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  u8 page = first;
+  int error = 0;
+
+  while (page <= last) {
+    u8 run_end = page;
+    u8 checked;
+
+    if (b3_data->page_state[page] == W1_DS2432_PAGE_TRUSTED) {
+      page++;
+      continue;
+    }
+
+    // Extend the run over the following pages that need a read as well.
+    while (run_end < last &&
+           b3_data->page_state[run_end + 1] != W1_DS2432_PAGE_TRUSTED) {
+      run_end++;
+    }
+
+    error = w1_b3_read_pages(sl, page, run_end,
+                             &b3_data->image[page * W1_DS2432_PAGE_SIZE]);
+
+    for (checked = page; b3_data->ecc && checked <= run_end && error == 0;
+         checked++) {
+      error = w1_b3_ecc_check(sl, checked);
+    }
+
+    for (; page <= run_end; page++) {
+      b3_data->page_state[page] =
+          error < 0 ? W1_DS2432_PAGE_EMPTY : W1_DS2432_PAGE_TRUSTED;
+    }
+    b3_data->image_gen++;
+
+    if (error < 0) {
+      return error;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Confirm imported pages with a single spot check.
+ *
+ * The first imported page is read back (authenticated when the slave has a
+ * secret configured, so that a genuine device and its content are proven at
+ * once) and compared with the cache. On a match every imported page is trusted;
+ * otherwise the import is dropped and pages are read normally.
+ *
+ * The caller must hold the bus_mutex.
+ */
+static int w1_b3_confirm_import(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  u8 page_data[W1_DS2432_PAGE_SIZE];
+  enum w1_ds2432_page_state state;
+  int spot = -1;
+  int page;
+  int error;
+
+  for (page = 0; page < W1_DS2432_PAGE_COUNT; page++) {
+    if (b3_data->page_state[page] == W1_DS2432_PAGE_UNVERIFIED) {
+      spot = page;
+      break;
+    }
+  }
+
+  if (spot < 0) {
     return 0;
   }
 
-  mutex_lock(&sl->master->bus_mutex);
+  if (b3_data->secret_source != W1_DS2432_SECRET_DEFAULT) {
+    error = w1_ds2432_authenticate_page(sl, w1_b3_secret(sl), spot, page_data);
+  } else {
+    error = w1_ds2432_read_authenticated_page(sl, spot, NULL, page_data, NULL);
+  }
 
-  if (w1_reset_select_slave(sl)) {
-    count = -EIO;
-    goto out_up;
+  if (error < 0 && error != -EACCES) {
+    return error;
   }
 
-  w1_ds2432_read_memory(sl, off, buf, count);
-out_up:
-  mutex_unlock(&sl->master->bus_mutex);
+  state = W1_DS2432_PAGE_TRUSTED;
+  if (error == -EACCES ||
+      memcmp(page_data, &b3_data->image[spot * W1_DS2432_PAGE_SIZE],
+             W1_DS2432_PAGE_SIZE)) {
+    dev_info(&sl->dev, "imported cache is stale, dropping it\n");
+    state = W1_DS2432_PAGE_EMPTY;
+  }
 
-  return count;
+  for (page = 0; page < W1_DS2432_PAGE_COUNT; page++) {
+    if (b3_data->page_state[page] == W1_DS2432_PAGE_UNVERIFIED) {
+      b3_data->page_state[page] = state;
+    }
+  }
+
+  // A genuine device with a stale import still gave us a good page.
+  if (error == 0) {
+    memcpy(&b3_data->image[spot * W1_DS2432_PAGE_SIZE], page_data,
+           W1_DS2432_PAGE_SIZE);
+    b3_data->page_state[spot] = W1_DS2432_PAGE_TRUSTED;
+  }
+  b3_data->image_gen++;
+
+  return 0;
+}
+
+/**
+ * Read [off, off + count) of the data memory through the cache, reading from
+ * the device only the pages that are not cached yet.
+ *
+ * The caller must hold the bus_mutex.
+ */
+static int w1_b3_read_cached(struct w1_slave *sl, loff_t off, u8 *buf,
+                             size_t count) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  int error;
+
+  error = w1_b3_confirm_import(sl);
+  if (error < 0) {
+    return error;
+  }
+
+  error = w1_b3_fill_pages(sl, off / W1_DS2432_PAGE_SIZE,
+                           (off + count - 1) / W1_DS2432_PAGE_SIZE);
+  if (error < 0) {
+    return error;
+  }
+
+  memcpy(buf, &b3_data->image[off], count);
+
+  return 0;
+}
+
+static int w1_b3_eprom_mode(struct w1_slave *sl);
+
+/**
+ * Keep the cache in sync with a block that was just copied to the device.
+ *
+ * page_data: the 32 bytes of the page as read before the copy
+ * from_cache: whether page_data came from a trusted page of the cache rather
+ *             than from the plain read done for the MAC
+ * error: the copy result
+ *
+ * The caller must hold the bus_mutex.
+ */
+static void w1_b3_cache_block_written(struct w1_slave *sl, u16 address,
+                                      const u8 *data, const u8 *page_data,
+                                      bool from_cache, int error) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  u8 page = address / W1_DS2432_PAGE_SIZE;
+  int eprom_mode = 0;
+  int i;
+
+  if (address >= W1_DS2432_DATA_MEMORY_SIZE) {
+    return;
+  }
+
+  if (page == 1 && error == 0) {
+    eprom_mode = w1_b3_eprom_mode(sl);
+    if (eprom_mode < 0) {
+      // Unknown whether the device merged the block in.
+      error = eprom_mode;
+    }
+  }
+
+  if (error == -EACCES || error == -EPERM) {
+    // The copy was refused, nothing changed.
+    return;
+  }
+
+  if (error < 0) {
+    // The copy may or may not have happened.
+    b3_data->page_state[page] = W1_DS2432_PAGE_EMPTY;
+    return;
+  }
+
+  if (!from_cache && w1_b3_read_mode(sl) != W1_DS2432_READ_PLAIN) {
+    // The plain read does not meet the slave's read mode; the next read of
+    // the page does.
+    b3_data->page_state[page] = W1_DS2432_PAGE_EMPTY;
+    b3_data->image_gen++;
+    return;
+  }
+
+  // The page was read just before the copy: it is now known in full.
+  memcpy(&b3_data->image[page * W1_DS2432_PAGE_SIZE], page_data,
+         W1_DS2432_PAGE_SIZE);
+  memcpy(&b3_data->image[address], data, 8);
+  if (eprom_mode) {
+    // In EPROM mode the device only clears bits.
+    for (i = 0; i < 8; i++) {
+      b3_data->image[address + i] &=
+          page_data[address % W1_DS2432_PAGE_SIZE + i];
+    }
+  }
+  b3_data->page_state[page] = W1_DS2432_PAGE_TRUSTED;
+  b3_data->image_gen++;
 }
 
 // Block-size are 8 bytes.
 static int eeprom_write_block(struct w1_slave *sl, u16 address,
                               const u8 *data) {
+  struct w1_b3_data *b3_data = sl->family_data;
   int error = 0;
   u16 sp_address = 0;
   u8 es = 0;
   u8 scratchpad[8] = {0};
   u8 data_memory_page[32] = {0};
-  struct w1_b3_data *b3_data = sl->family_data;
+  u8 page = address / W1_DS2432_PAGE_SIZE;
+  bool from_cache;
+  const u8 *mac_template;
   struct sha1 mac;
 
-  // 1. Read the first 28 bytes of the target address to generate the MAC.
-  error = w1_ds2432_read_memory(sl, (address / 32) * 32, data_memory_page,
-                                sizeof(data_memory_page));
-  if (error < 0) {
-    return error;
+  // 0. Settle the secret before the scratchpad is in use.
+  mac_template = w1_b3_mac_template(sl);
+
+  // 1. The first 28 bytes of the target page go into the MAC: take them from
+  // the cache when it holds the page, read them otherwise.
+  from_cache = address < W1_DS2432_DATA_MEMORY_SIZE &&
+               b3_data->page_state[page] == W1_DS2432_PAGE_TRUSTED;
+  if (from_cache) {
+    memcpy(data_memory_page, &b3_data->image[page * W1_DS2432_PAGE_SIZE],
+           sizeof(data_memory_page));
+  } else {
+    error = w1_ds2432_read_memory(sl, (address / 32) * 32, data_memory_page,
+                                  sizeof(data_memory_page));
+    if (error < 0) {
+      return error;
+    }
   }
 
   // 2. Write data to the scratchpad.
@@ -580,449 +2445,4357 @@ static int eeprom_write_block(struct w1_slave *sl, u16 address,
   if (sp_address != address) {
     dev_err(&sl->dev, "unexpected address: %04x (expected: %04x)\n", sp_address,
             address);
+    w1_b3_link_error(sl, W1_DS2432_LINK_CRC);
     // EIO: invalid address, probably due to i/o.
     return -EIO;
   }
 
   if ((es >> 5) & 1) {
     dev_err(&sl->dev, "ES partial byte is 1\n");
+    w1_b3_link_error(sl, W1_DS2432_LINK_STATUS);
     // EIO: invalid ES byte, probably due to i/o issue.
     return -EIO;
   }
 
   if (memcmp(scratchpad, data, 8)) {
     dev_err(&sl->dev, "scratchpad data does not match\n");
+    w1_b3_link_error(sl, W1_DS2432_LINK_CRC);
     // EIO: data read is not equal to what was sent, probably due to i/o.
     return -EIO;
   }
 
   // 4. Generate MAC
-  generate_mac(b3_data->secret, scratchpad, address, data_memory_page,
-               b3_data->registration_number, &mac, sl);
+  generate_mac_from_template(mac_template, scratchpad, address,
+                             data_memory_page, &mac);
 
   // 5. Issue copy scratchpad.
   error = w1_ds2432_copy_scratchpad(sl, sp_address, es, &mac);
 
+  if (error == -EACCES && from_cache) {
+    // Most likely a wrong secret, which another copy would not fix; but the
+    // page may also have changed behind the cache's back, so the next write
+    // takes it from the device.
+    b3_data->page_state[page] = W1_DS2432_PAGE_EMPTY;
+  }
+
+  w1_b3_cache_block_written(sl, address, data, data_memory_page, from_cache,
+                            error);
+
   return error;
 }
 
-static ssize_t eeprom_write(struct file *filp, struct kobject *kobj,
-                            struct bin_attribute *bin_attr, char *buf,
-                            loff_t off, size_t count) {
-  struct w1_slave *sl = kobj_to_w1_slave(kobj);
-  int result = 0;
-  u8 address = 0;
-
-  mutex_lock(&sl->master->bus_mutex);
+/**
+ * Add the check bytes of `page` to a batch of block writes (see
+ * w1_b3_run_batch()), computed over the page as the batch leaves it. The
+ * bytes written there by the requests are ignored. When the rest of the page
+ * cannot be read, its blocks fail.
+ *
+ * The caller must hold the bus_mutex.
+ */
+static void w1_b3_ecc_prepare(struct w1_slave *sl, u8 page, u8 *blocks,
+                              u8 *mask, int *block_error) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  const int blocks_per_page = W1_DS2432_PAGE_SIZE / W1_DS2432_BLOCK_SIZE;
+  const u8 *cached = &b3_data->image[page * W1_DS2432_PAGE_SIZE];
+  u8 *written = &blocks[page * W1_DS2432_PAGE_SIZE];
+  u8 *page_mask = &mask[page * blocks_per_page];
+  u8 data[W1_DS2432_PAGE_SIZE];
+  bool touched = false;
+  bool complete = true;
+  int error;
+  int i;
+
+  for (i = 0; i < W1_DS2432_ECC_DATA_SIZE; i++) {
+    if (page_mask[i / W1_DS2432_BLOCK_SIZE] & BIT(i % W1_DS2432_BLOCK_SIZE)) {
+      touched = true;
+    } else {
+      complete = false;
+    }
+  }
 
-  if (w1_reset_select_slave(sl)) {
-    count = -EIO;
-    goto out_up;
+  if (!touched && !page_mask[blocks_per_page - 1]) {
+    return;
   }
 
-  // We can only write 8 bytes at a time
-  while (address < count) {
-    result = eeprom_write_block(sl, address, &buf[address]);
-    if (result < 0) {
-      count = result;
-      goto out_up;
+  if (!complete) {
+    error = w1_b3_fill_pages(sl, page, page);
+    if (error < 0) {
+      for (i = 0; i < blocks_per_page; i++) {
+        if (page_mask[i]) {
+          block_error[page * blocks_per_page + i] = error;
+          page_mask[i] = 0;
+        }
+      }
+      return;
     }
-
-    address += 8;
   }
 
-out_up:
-  mutex_unlock(&sl->master->bus_mutex);
+  for (i = 0; i < W1_DS2432_ECC_DATA_SIZE; i++) {
+    data[i] = page_mask[i / W1_DS2432_BLOCK_SIZE] &
+                      BIT(i % W1_DS2432_BLOCK_SIZE)
+                  ? written[i]
+                  : cached[i];
+  }
+  w1_ds2432_ecc_encode(data);
+
+  // A write that leaves the code as it is spares the last block.
+  if (!page_mask[blocks_per_page - 1] &&
+      !memcmp(&data[W1_DS2432_ECC_DATA_SIZE],
+              &cached[W1_DS2432_ECC_DATA_SIZE],
+              W1_DS2432_PAGE_SIZE - W1_DS2432_ECC_DATA_SIZE)) {
+    return;
+  }
 
-  return count;
+  for (i = W1_DS2432_ECC_DATA_SIZE; i < W1_DS2432_PAGE_SIZE; i++) {
+    written[i] = data[i];
+    page_mask[i / W1_DS2432_BLOCK_SIZE] |= BIT(i % W1_DS2432_BLOCK_SIZE);
+  }
 }
 
-static BIN_ATTR_RW(eeprom, W1_DS2432_DATA_MEMORY_SIZE);
+/**
+ * Serve a batch of queued data memory requests in one bus session.
+ *
+ * Writes go first. They are folded into per-block byte masks in submission
+ * order, so several writes to the same block cost a single copy scratchpad,
+ * and the blocks are then copied in address order. A partially written block
+ * is completed from the cache, and the page each copy needs for its MAC is
+ * read at most once. With the ECC layout, the check bytes of every written page
+ * are recomputed and copied along. Reads are served afterwards from the cache,
+ * filled over the union of the requested pages in runs of adjacent pages.
+ *
+ * Without the `cache` parameter the cache only lives for the batch.
+ *
+ * The caller must hold the bus_mutex.
+ */
+static void w1_b3_run_batch(struct w1_slave *sl, struct list_head *batch) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  struct w1_ds2432_request *req, *tmp;
+  u8 blocks[W1_DS2432_DATA_MEMORY_SIZE];
+  u8 mask[W1_DS2432_BLOCK_COUNT] = {0};
+  int block_error[W1_DS2432_BLOCK_COUNT] = {0};
+  int page_error[W1_DS2432_PAGE_COUNT] = {0};
+  bool keep_cache = READ_ONCE(cache);
+  u8 read_pages = 0;
+  int error;
+  int block;
+  int page;
+  int i;
+
+  if (!keep_cache) {
+    w1_b3_invalidate_cache(sl);
+  }
 
-//
-// SECRET MEMORY
-//
-// 0080h to 0087h - No read access; secret not required for write access
-//
+  list_for_each_entry(req, batch, entry) {
+    if (req->write) {
+      for (i = 0; i < req->count; i++) {
+        blocks[req->off + i] = req->buf[i];
+        mask[(req->off + i) / W1_DS2432_BLOCK_SIZE] |=
+            BIT((req->off + i) % W1_DS2432_BLOCK_SIZE);
+      }
+    } else {
+      for (page = req->off / W1_DS2432_PAGE_SIZE;
+           page <= (req->off + req->count - 1) / W1_DS2432_PAGE_SIZE; page++) {
+        read_pages |= BIT(page);
+      }
+    }
+  }
 
-static ssize_t secret_read(struct file *filp, struct kobject *kobj,
-                           struct bin_attribute *bin_attr, char *buf,
-                           loff_t off, size_t count) {
-  struct w1_slave *sl = kobj_to_w1_slave(kobj);
-  struct w1_b3_data *b3_data = sl->family_data;
+  // Imported pages are confirmed before anything relies on them.
+  error = w1_b3_confirm_import(sl);
 
-  memcpy(buf, b3_data->secret, 8);
+  for (page = 0; b3_data->ecc && error == 0 && page < W1_DS2432_PAGE_COUNT;
+       page++) {
+    w1_b3_ecc_prepare(sl, page, blocks, mask, block_error);
+  }
 
-  return 8;
-}
+  for (block = 0; block < W1_DS2432_BLOCK_COUNT; block++) {
+    u16 address = block * W1_DS2432_BLOCK_SIZE;
+    u8 data[W1_DS2432_BLOCK_SIZE];
 
-static ssize_t secret_write(struct file *filp, struct kobject *kobj,
-                            struct bin_attribute *bin_attr, char *buf,
-                            loff_t off, size_t count) {
-  struct w1_slave *sl = kobj_to_w1_slave(kobj);
-  struct w1_b3_data *b3_data = sl->family_data;
+    if (!mask[block]) {
+      continue;
+    }
 
-  memcpy(b3_data->secret, buf, 8);
+    if (error < 0) {
+      block_error[block] = error;
+      continue;
+    }
 
-  return count;
-}
+    if (mask[block] != 0xff) {
+      // The bytes nobody wrote keep their current value.
+      page = address / W1_DS2432_PAGE_SIZE;
+      block_error[block] = w1_b3_fill_pages(sl, page, page);
+      if (block_error[block] < 0) {
+        continue;
+      }
+    }
 
-static BIN_ATTR_RW(secret, 8);
+    for (i = 0; i < W1_DS2432_BLOCK_SIZE; i++) {
+      data[i] = mask[block] & BIT(i) ? blocks[address + i]
+                                     : b3_data->image[address + i];
+    }
 
-static ssize_t secret_sync_read(struct file *filp, struct kobject *kobj,
-                                struct bin_attribute *bin_attr, char *buf,
-                                loff_t off, size_t count) {
-  // secret_sync is not readable.
-  return 0;
-}
+    block_error[block] = eeprom_write_block(sl, address, data);
+  }
 
-static ssize_t secret_sync_write(struct file *filp, struct kobject *kobj,
-                                 struct bin_attribute *bin_attr, char *buf,
-                                 loff_t off, size_t count) {
-  struct w1_slave *sl = kobj_to_w1_slave(kobj);
-  struct w1_b3_data *b3_data = sl->family_data;
+  for (page = 0; page < W1_DS2432_PAGE_COUNT; page++) {
+    int last = page;
 
-  mutex_lock(&sl->master->bus_mutex);
+    if (!(read_pages & BIT(page))) {
+      continue;
+    }
+
+    while (last + 1 < W1_DS2432_PAGE_COUNT && (read_pages & BIT(last + 1))) {
+      last++;
+    }
+
+    if (error == 0) {
+      error = w1_b3_fill_pages(sl, page, last);
+    }
+
+    for (; page <= last; page++) {
+      page_error[page] = error;
+    }
+
+    // Only a gone device spoils the following runs.
+    if (error != -ENODEV) {
+      error = 0;
+    }
+  }
+
+  list_for_each_entry_safe(req, tmp, batch, entry) {
+    int first, last, n;
+    int result = 0;
+
+    if (req->write) {
+      first = req->off / W1_DS2432_BLOCK_SIZE;
+      last = (req->off + req->count - 1) / W1_DS2432_BLOCK_SIZE;
+    } else {
+      first = req->off / W1_DS2432_PAGE_SIZE;
+      last = (req->off + req->count - 1) / W1_DS2432_PAGE_SIZE;
+    }
+
+    for (n = first; n <= last && result == 0; n++) {
+      result = req->write ? block_error[n] : page_error[n];
+    }
+
+    if (result == 0) {
+      if (!req->write) {
+        memcpy(req->buf, &b3_data->image[req->off], req->count);
+      }
+      result = req->count;
+    }
+
+    req->result = result;
+    list_del(&req->entry);
+    complete(&req->done);
+  }
+
+  if (!keep_cache) {
+    w1_b3_invalidate_cache(sl);
+  }
+}
+
+// Serve one data memory access as a batch of its own, so that it goes through
+// the cache and ECC handling like a queued one. The caller must hold the
+// bus_mutex.
+static int w1_b3_io_locked(struct w1_slave *sl, bool write, u8 off, u8 *buf,
+                           u8 count) {
+  struct w1_ds2432_request req = {
+      .write = write,
+      .off = off,
+      .count = count,
+      .buf = buf,
+  };
+  LIST_HEAD(batch);
+
+  init_completion(&req.done);
+  list_add_tail(&req.entry, &batch);
+  w1_b3_run_batch(sl, &batch);
+
+  return req.result < 0 ? req.result : 0;
+}
+
+/**
+ * Read or write [off, off + count) of the data memory through the slave's
+ * request queue.
+ *
+ * The first caller to find the queue idle becomes its dispatcher: it takes the
+ * bus and serves whatever got queued while it waited for it. Once its own
+ * request is served, it hands dispatching over to the oldest waiter, so that
+ * no caller keeps serving others under steady load. Everyone else just waits
+ * for their request to be served, or to be handed the dispatch.
+ *
+ * Returns count, or a negative error.
+ */
+static ssize_t w1_b3_queue_io(struct w1_slave *sl, bool write, loff_t off,
+                              u8 *buf, size_t count) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  struct w1_ds2432_request req = {
+      .write = write,
+      .off = off,
+      .count = count,
+      .buf = buf,
+  };
+  LIST_HEAD(batch);
+
+  if (count == 0) {
+    return 0;
+  }
+
+  init_completion(&req.done);
+
+  mutex_lock(&b3_data->queue_lock);
+  list_add_tail(&req.entry, &b3_data->queue);
+  if (b3_data->dispatching) {
+    mutex_unlock(&b3_data->queue_lock);
+    wait_for_completion(&req.done);
+    if (!req.dispatch) {
+      return req.result;
+    }
+    // Handed the dispatch; the request is still queued.
+    req.dispatch = false;
+    reinit_completion(&req.done);
+  } else {
+    b3_data->dispatching = true;
+    mutex_unlock(&b3_data->queue_lock);
+  }
+
+  while (!completion_done(&req.done)) {
+    w1_b3_lock(sl);
+
+    mutex_lock(&b3_data->queue_lock);
+    list_splice_init(&b3_data->queue, &batch);
+    mutex_unlock(&b3_data->queue_lock);
+
+    w1_b3_run_batch(sl, &batch);
+    w1_b3_unlock(sl);
+  }
+
+  mutex_lock(&b3_data->queue_lock);
+  if (list_empty(&b3_data->queue)) {
+    b3_data->dispatching = false;
+  } else {
+    struct w1_ds2432_request *next = list_first_entry(
+        &b3_data->queue, struct w1_ds2432_request, entry);
+
+    next->dispatch = true;
+    complete(&next->done);
+  }
+  mutex_unlock(&b3_data->queue_lock);
+
+  return req.result;
+}
+
+static void w1_b3_fields_retry(struct w1_slave *sl);
+
+static ssize_t eeprom_read(struct file *filp, struct kobject *kobj,
+                           struct bin_attribute *bin_attr, char *buf,
+                           loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+
+  w1_b3_fields_retry(sl);
+
+  count = w1_b3_fix_count(off, count, W1_DS2432_DATA_MEMORY_SIZE);
+
+  return w1_b3_queue_io(sl, false, off, buf, count);
+}
+
+static ssize_t eeprom_write(struct file *filp, struct kobject *kobj,
+                            struct bin_attribute *bin_attr, char *buf,
+                            loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+
+  w1_b3_fields_retry(sl);
+
+  count = w1_b3_fix_count(off, count, W1_DS2432_DATA_MEMORY_SIZE);
+
+  return w1_b3_queue_io(sl, true, off, buf, count);
+}
+
+static BIN_ATTR_RW(eeprom, W1_DS2432_DATA_MEMORY_SIZE);
+
+//
+// Record store
+//
+// An optional layer of small typed records over the data memory:
+//
+//   0000h  'T' 'L'                     store magic
+//   0002h  id, length, value[length]   one record, repeated
+//          FFh (or 00h)                end of the records
+//
+// Record IDs go from 01h to FDh, FEh marks a deleted record. Lookups use an
+// index of the record offsets built from the cache, so they cost no bus
+// traffic once the memory is cached. Updates compute the new image and write
+// only the 8-byte blocks that changed: a same-size update rewrites its value,
+// a resize deletes the record in place and appends it, and the store is only
+// compacted when the free space runs out.
+//
+
+#define W1_DS2432_RECORD_MAGIC          "TL"
+#define W1_DS2432_RECORD_START          2
+#define W1_DS2432_RECORD_HEADER         2
+#define W1_DS2432_RECORD_DELETED        0xFE
+#define W1_DS2432_RECORD_END            0xFF
+
+static inline bool w1_ds2432_record_end(u8 id) {
+  return id == W1_DS2432_RECORD_END || id == 0x00;
+}
+
+// Walk the records of `image`, calling `fn` on every live one. Returns the
+// offset just past the last record, or -EBADMSG when a record overflows.
+static int w1_ds2432_records_walk(const u8 *image,
+                                  void (*fn)(void *ctx, u8 id, u8 offset),
+                                  void *ctx) {
+  unsigned int pos = W1_DS2432_RECORD_START;
+
+  while (pos + W1_DS2432_RECORD_HEADER <= W1_DS2432_DATA_MEMORY_SIZE &&
+         !w1_ds2432_record_end(image[pos])) {
+    unsigned int next = pos + W1_DS2432_RECORD_HEADER + image[pos + 1];
+
+    if (next > W1_DS2432_DATA_MEMORY_SIZE) {
+      return -EBADMSG;
+    }
+
+    if (image[pos] != W1_DS2432_RECORD_DELETED && fn) {
+      fn(ctx, image[pos], pos);
+    }
+
+    pos = next;
+  }
+
+  return pos;
+}
+
+static void w1_b3_records_index_one(void *ctx, u8 id, u8 offset) {
+  struct w1_b3_data *b3_data = ctx;
+
+  // A later duplicate shadows the earlier one.
+  b3_data->record_offset[id] = offset;
+}
+
+/**
+ * Make the record index current, filling the cache first if needed.
+ *
+ * Returns 0, -ENODATA when the memory holds no record store, -EBADMSG when
+ * the store is corrupted, -EOPNOTSUPP with the ECC layout, or a bus error.
+ *
+ * The caller must hold the bus_mutex.
+ */
+static int w1_b3_records_load(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  bool trusted = true;
+  int page;
+  int end;
+  int error;
+
+  // Records run across the check bytes of the ECC layout.
+  if (b3_data->ecc) {
+    return -EOPNOTSUPP;
+  }
 
-  if (w1_reset_select_slave(sl)) {
-    count = -EIO;
+  if (!READ_ONCE(cache)) {
+    w1_b3_invalidate_cache(sl);
+  }
+
+  for (page = 0; page < W1_DS2432_PAGE_COUNT; page++) {
+    trusted &= b3_data->page_state[page] == W1_DS2432_PAGE_TRUSTED;
+  }
+
+  if (!trusted || !b3_data->records_valid ||
+      b3_data->records_gen != b3_data->image_gen) {
+    error = w1_b3_confirm_import(sl);
+    if (error < 0) {
+      return error;
+    }
+
+    error = w1_b3_fill_pages(sl, 0, W1_DS2432_PAGE_COUNT - 1);
+    if (error < 0) {
+      return error;
+    }
+
+    memset(b3_data->record_offset, 0, sizeof(b3_data->record_offset));
+    b3_data->records_present =
+        !memcmp(b3_data->image, W1_DS2432_RECORD_MAGIC, 2);
+    b3_data->records_end = W1_DS2432_RECORD_START;
+    b3_data->records_valid = false;
+
+    if (b3_data->records_present) {
+      end = w1_ds2432_records_walk(b3_data->image, w1_b3_records_index_one,
+                                   b3_data);
+      if (end < 0) {
+        dev_err(&sl->dev, "record store is corrupted\n");
+        return end;
+      }
+      b3_data->records_end = end;
+    }
+
+    b3_data->records_gen = b3_data->image_gen;
+    b3_data->records_valid = true;
+  }
+
+  return b3_data->records_present ? 0 : -ENODATA;
+}
+
+/**
+ * Copy record `id` into `buf`, at most `size` bytes.
+ *
+ * Returns the record length, which may exceed `size`, -ENOENT when there is
+ * no such record, or the errors of w1_b3_records_load().
+ */
+static int w1_b3_record_read(struct w1_slave *sl, u8 id, u8 *buf,
+                             size_t size) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  u8 offset;
+  int error;
+
+  w1_b3_lock(sl);
+
+  error = w1_b3_records_load(sl);
+  if (error < 0) {
+    goto out_up;
+  }
+
+  offset = b3_data->record_offset[id];
+  if (!offset) {
+    error = -ENOENT;
     goto out_up;
   }
 
-  w1_ds2432_write_secret(sl, b3_data->secret);
+  error = b3_data->image[offset + 1];
+  memcpy(buf, &b3_data->image[offset + W1_DS2432_RECORD_HEADER],
+         min_t(size_t, error, size));
 
 out_up:
-  mutex_unlock(&sl->master->bus_mutex);
+  w1_b3_unlock(sl);
+
+  return error;
+}
+
+// Write the blocks of `image` that differ from `old`, one request per run of
+// adjacent changed blocks. The caller must hold the bus_mutex.
+static int w1_b3_records_write(struct w1_slave *sl, const u8 *old, u8 *image) {
+  unsigned int first;
+  unsigned int last;
+  int result;
+
+  for (first = 0; first < W1_DS2432_DATA_MEMORY_SIZE;
+       first += W1_DS2432_BLOCK_SIZE) {
+    if (!memcmp(&old[first], &image[first], W1_DS2432_BLOCK_SIZE)) {
+      continue;
+    }
+
+    last = first + W1_DS2432_BLOCK_SIZE;
+    while (last < W1_DS2432_DATA_MEMORY_SIZE &&
+           memcmp(&old[last], &image[last], W1_DS2432_BLOCK_SIZE)) {
+      last += W1_DS2432_BLOCK_SIZE;
+    }
+
+    result = w1_b3_io_locked(sl, true, first, &image[first], last - first);
+    if (result < 0) {
+      return result;
+    }
+
+    first = last;
+  }
+
+  return 0;
+}
+
+// Write `image` over `old` like w1_b3_records_write(), but with the block
+// holding offset `publish` (when not negative) last: whatever that block makes
+// reachable is then complete on the device before it is. The caller must hold
+// the bus_mutex.
+static int w1_b3_records_commit(struct w1_slave *sl, const u8 *old, u8 *image,
+                                int publish) {
+  u8 staged[W1_DS2432_DATA_MEMORY_SIZE];
+  unsigned int block;
+  int error;
+
+  if (publish >= 0) {
+    block = publish - publish % W1_DS2432_BLOCK_SIZE;
+    memcpy(staged, image, sizeof(staged));
+    memcpy(&staged[block], &old[block], W1_DS2432_BLOCK_SIZE);
+
+    error = w1_b3_records_write(sl, old, staged);
+    if (error < 0) {
+      return error;
+    }
+    old = staged;
+  }
+
+  return w1_b3_records_write(sl, old, image);
+}
+
+// Squeeze out deleted records. Returns the new end of the records.
+static unsigned int w1_ds2432_records_compact(u8 *image) {
+  u8 live[W1_DS2432_DATA_MEMORY_SIZE];
+  unsigned int pos = W1_DS2432_RECORD_START;
+  unsigned int end = W1_DS2432_RECORD_START;
+
+  memcpy(live, image, sizeof(live));
+
+  while (pos + W1_DS2432_RECORD_HEADER <= W1_DS2432_DATA_MEMORY_SIZE &&
+         !w1_ds2432_record_end(live[pos])) {
+    unsigned int size = W1_DS2432_RECORD_HEADER + live[pos + 1];
+
+    if (live[pos] != W1_DS2432_RECORD_DELETED) {
+      memmove(&image[end], &live[pos], size);
+      end += size;
+    }
+
+    pos += size;
+  }
+
+  return end;
+}
+
+/**
+ * Create, replace or, with a NULL `value`, delete record `id`; or with id 0,
+ * format an empty store.
+ *
+ * Record updates are serialized by update_lock. The image is computed and
+ * written back under a single hold of the bus_mutex, so no other writer can
+ * slip in between. A record is appended before its end marker makes it
+ * reachable, and a moved record is written at its new place before the old
+ * copy is marked deleted (until then the later copy shadows it). Compacting a
+ * full store rewrites it in place and is not safe against power loss.
+ */
+static int w1_b3_record_update(struct w1_slave *sl, u8 id, const u8 *value,
+                               size_t length) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  u8 old[W1_DS2432_DATA_MEMORY_SIZE];
+  u8 image[W1_DS2432_DATA_MEMORY_SIZE];
+  unsigned int end;
+  int publish = -1;
+  u8 offset;
+  int error;
+
+  if (id == W1_DS2432_RECORD_DELETED || id == W1_DS2432_RECORD_END ||
+      length > W1_DS2432_RECORD_MAX_LEN) {
+    return -EINVAL;
+  }
+
+  mutex_lock(&b3_data->update_lock);
+  w1_b3_lock(sl);
+
+  error = w1_b3_records_load(sl);
+  if (id == 0 && (error == 0 || error == -ENODATA || error == -EBADMSG)) {
+    error = 0;
+  }
+  if (error < 0) {
+    goto out;
+  }
+
+  memcpy(old, b3_data->image, sizeof(old));
+  memcpy(image, old, sizeof(image));
+  offset = b3_data->record_offset[id];
+  end = b3_data->records_end;
+
+  if (id == 0) {
+    memcpy(image, W1_DS2432_RECORD_MAGIC, 2);
+    image[W1_DS2432_RECORD_START] = W1_DS2432_RECORD_END;
+  } else if (!value) {
+    if (!offset) {
+      error = -ENOENT;
+      goto out;
+    }
+    image[offset] = W1_DS2432_RECORD_DELETED;
+  } else if (offset && image[offset + 1] == length) {
+    memcpy(&image[offset + W1_DS2432_RECORD_HEADER], value, length);
+  } else {
+    if (end + W1_DS2432_RECORD_HEADER + length > W1_DS2432_DATA_MEMORY_SIZE) {
+      if (offset) {
+        image[offset] = W1_DS2432_RECORD_DELETED;
+        offset = 0;
+      }
+      end = w1_ds2432_records_compact(image);
+    } else {
+      // The old end marker turns into the new record's ID last.
+      publish = end;
+    }
+
+    if (end + W1_DS2432_RECORD_HEADER + length > W1_DS2432_DATA_MEMORY_SIZE) {
+      error = -ENOSPC;
+      goto out;
+    }
+
+    image[end] = id;
+    image[end + 1] = length;
+    memcpy(&image[end + W1_DS2432_RECORD_HEADER], value, length);
+    end += W1_DS2432_RECORD_HEADER + length;
+
+    if (end < W1_DS2432_DATA_MEMORY_SIZE) {
+      image[end] = W1_DS2432_RECORD_END;
+    }
+
+    if (offset) {
+      // New copy first, then the old one goes.
+      error = w1_b3_records_commit(sl, old, image, publish);
+      if (error < 0) {
+        goto out;
+      }
+      memcpy(old, image, sizeof(old));
+      image[offset] = W1_DS2432_RECORD_DELETED;
+      publish = -1;
+    }
+  }
+
+  error = w1_b3_records_commit(sl, old, image, publish);
+
+out:
+  w1_b3_unlock(sl);
+  mutex_unlock(&b3_data->update_lock);
+
+  return error;
+}
+
+// Each record reads and writes at offset id * W1_DS2432_DATA_MEMORY_SIZE, e.g.
+// with dd bs=128 skip=<id>. A write replaces the whole value.
+static ssize_t records_read(struct file *filp, struct kobject *kobj,
+                            struct bin_attribute *bin_attr, char *buf,
+                            loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  u8 value[W1_DS2432_RECORD_MAX_LEN];
+  size_t skip = off % W1_DS2432_DATA_MEMORY_SIZE;
+  int length;
+
+  length = w1_b3_record_read(sl, off / W1_DS2432_DATA_MEMORY_SIZE, value,
+                             sizeof(value));
+  if (length < 0) {
+    return length;
+  }
+
+  if (skip >= length) {
+    return 0;
+  }
+
+  count = min_t(size_t, count, length - skip);
+  memcpy(buf, &value[skip], count);
 
   return count;
 }
 
-static BIN_ATTR_RW(secret_sync, 1);
+static ssize_t records_write(struct file *filp, struct kobject *kobj,
+                             struct bin_attribute *bin_attr, char *buf,
+                             loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  u8 id = off / W1_DS2432_DATA_MEMORY_SIZE;
+  int error;
+
+  if (off % W1_DS2432_DATA_MEMORY_SIZE || id == 0) {
+    return -EINVAL;
+  }
+
+  error = w1_b3_record_update(sl, id, buf, count);
+
+  return error < 0 ? error : count;
+}
+
+static BIN_ATTR_RW(records, 256 * W1_DS2432_DATA_MEMORY_SIZE);
+
+struct w1_ds2432_record_list {
+  u8 *buf;
+  size_t len;
+};
+
+static void w1_ds2432_record_list_one(void *ctx, u8 id, u8 offset) {
+  struct w1_ds2432_record_list *list = ctx;
+
+  list->buf[list->len++] = id;
+  list->buf[list->len++] = offset;
+}
+
+// The live records as (id, offset, length) triples, in memory order. Writing
+// "format" creates an empty store, "delete <id>" deletes a record.
+static ssize_t record_index_read(struct file *filp, struct kobject *kobj,
+                                 struct bin_attribute *bin_attr, char *buf,
+                                 loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+  u8 pairs[W1_DS2432_DATA_MEMORY_SIZE];
+  u8 index[W1_DS2432_DATA_MEMORY_SIZE / W1_DS2432_RECORD_HEADER * 3];
+  struct w1_ds2432_record_list list = {.buf = pairs};
+  size_t len = 0;
+  size_t i;
+  int error;
+
+  w1_b3_lock(sl);
+  error = w1_b3_records_load(sl);
+  if (error == 0) {
+    w1_ds2432_records_walk(b3_data->image, w1_ds2432_record_list_one, &list);
+
+    for (i = 0; i < list.len; i += 2) {
+      // Skip the records shadowed by a later duplicate.
+      if (b3_data->record_offset[pairs[i]] != pairs[i + 1]) {
+        continue;
+      }
+      index[len++] = pairs[i];
+      index[len++] = pairs[i + 1];
+      index[len++] = b3_data->image[pairs[i + 1] + 1];
+    }
+  }
+  w1_b3_unlock(sl);
+
+  if (error < 0) {
+    return error;
+  }
+
+  if ((count = w1_b3_fix_count(off, count, len)) == 0) {
+    return 0;
+  }
+
+  memcpy(buf, &index[off], count);
+
+  return count;
+}
+
+static ssize_t record_index_write(struct file *filp, struct kobject *kobj,
+                                  struct bin_attribute *bin_attr, char *buf,
+                                  loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  char command[16];
+  u8 id;
+  int error;
+
+  if (count >= sizeof(command)) {
+    return -EINVAL;
+  }
+
+  memcpy(command, buf, count);
+  command[count] = '\0';
+  strim(command);
+
+  if (!strcmp(command, "format")) {
+    error = w1_b3_record_update(sl, 0, NULL, 0);
+  } else if (!strncmp(command, "delete ", 7) &&
+             !kstrtou8(command + 7, 0, &id) && id != 0) {
+    error = w1_b3_record_update(sl, id, NULL, 0);
+  } else {
+    error = -EINVAL;
+  }
+
+  return error < 0 ? error : count;
+}
+
+static BIN_ATTR_RW(record_index,
+                   W1_DS2432_DATA_MEMORY_SIZE / W1_DS2432_RECORD_HEADER * 3);
 
 //
-// REGISTER PAGE
+// Usage counters
 //
-// 0088h Write-protect secret, 008Ch to 008Fh - Protection activated by code AAh
-// or 55h 0089h Write-protect pages 0 to 3 - Protection activated by code AAh or
-// 55h 008Ah User byte, self-protecting - Protection activated by code AAh or
-// 55h 008Bh Factory byte (read only) - Reads either AAh or 55h 008Ch User
-// byte/EPROM mode control for page 1Mode - activated by code AAh or 55h 008Dh
-// User byte/Write-protect page 0 only - Protection activated by code AAh or 55h
-// 008Eh to 008Fh User Bytes/Manufacturer ID - Function depends on factory byte
-// 0090h to 0097h 64-Bit Registration Number (Alternate readout)
+// A counter occupies a region of whole 8-byte blocks. Each block is a slot
+// holding a value and its complement (both u32, little-endian), and every
+// increment writes the new value to the slot following the current one: one
+// block copy per increment, with the wear spread over the region. The current
+// value is the highest valid slot, found in the cached image; a region with
+// no valid slot counts 0. At least two slots are needed, so that a torn copy
+// always leaves the previous value behind.
 //
 
-static ssize_t register_page_read(struct file *filp, struct kobject *kobj,
-                                  struct bin_attribute *bin_attr, char *buf,
-                                  loff_t off, size_t count) {
-  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+static int w1_ds2432_counter_check(unsigned int offset, unsigned int blocks) {
+  if (offset % W1_DS2432_BLOCK_SIZE || blocks < 2 ||
+      offset + blocks * W1_DS2432_BLOCK_SIZE > W1_DS2432_DATA_MEMORY_SIZE) {
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
+// Find the slot holding the current value, -1 when there is none.
+static int w1_ds2432_counter_locate(const u8 *region, unsigned int blocks,
+                                    u32 *value) {
+  int current_slot = -1;
+  unsigned int slot;
+
+  *value = 0;
+
+  for (slot = 0; slot < blocks; slot++) {
+    const u8 *block = &region[slot * W1_DS2432_BLOCK_SIZE];
+    u32 slot_value = get_unaligned_le32(block);
+
+    if (slot_value != ~get_unaligned_le32(block + 4)) {
+      // Never written, or torn.
+      continue;
+    }
+
+    if (current_slot < 0 || slot_value > *value) {
+      current_slot = slot;
+      *value = slot_value;
+    }
+  }
+
+  return current_slot;
+}
+
+static int w1_b3_counter_read(struct w1_slave *sl, unsigned int offset,
+                              unsigned int blocks, u32 *value) {
+  u8 region[W1_DS2432_DATA_MEMORY_SIZE];
+  ssize_t result;
+
+  if (w1_ds2432_counter_check(offset, blocks) < 0) {
+    return -EINVAL;
+  }
+
+  result = w1_b3_queue_io(sl, false, offset, region,
+                          blocks * W1_DS2432_BLOCK_SIZE);
+  if (result < 0) {
+    return result;
+  }
+
+  w1_ds2432_counter_locate(region, blocks, value);
+
+  return 0;
+}
+
+// Add `amount` to a counter, storing the new value in `value` when not NULL.
+// Increments of a slave are serialized by update_lock.
+static int w1_b3_counter_add(struct w1_slave *sl, unsigned int offset,
+                             unsigned int blocks, u32 amount, u32 *value) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  u8 region[W1_DS2432_DATA_MEMORY_SIZE];
+  u8 block[W1_DS2432_BLOCK_SIZE];
+  unsigned int next;
+  u32 current_value;
+  ssize_t result;
+  int slot;
+
+  if (w1_ds2432_counter_check(offset, blocks) < 0) {
+    return -EINVAL;
+  }
+
+  // Check bytes are recomputed on every write, which would tear the slot.
+  if (READ_ONCE(b3_data->ecc) &&
+      w1_ds2432_ecc_overlaps(offset, blocks * W1_DS2432_BLOCK_SIZE)) {
+    return -EINVAL;
+  }
+
+  mutex_lock(&b3_data->update_lock);
+
+  result = w1_b3_queue_io(sl, false, offset, region,
+                          blocks * W1_DS2432_BLOCK_SIZE);
+  if (result < 0) {
+    goto out;
+  }
+
+  slot = w1_ds2432_counter_locate(region, blocks, &current_value);
+
+  if (amount > U32_MAX - current_value) {
+    result = -EOVERFLOW;
+    goto out;
+  }
+  current_value += amount;
+
+  next = (slot + 1) % blocks;
+  put_unaligned_le32(current_value, block);
+  put_unaligned_le32(~current_value, block + 4);
+
+  result = w1_b3_queue_io(sl, true, offset + next * W1_DS2432_BLOCK_SIZE,
+                          block, sizeof(block));
+  if (result >= 0 && value) {
+    *value = current_value;
+  }
+
+out:
+  mutex_unlock(&b3_data->update_lock);
+
+  return result < 0 ? result : 0;
+}
+
+//
+// eeprom read mode: '0' plain, '1' CRC checked, '2' CRC and MAC checked
+//
+
+static ssize_t read_mode_read(struct file *filp, struct kobject *kobj,
+                              struct bin_attribute *bin_attr, char *buf,
+                              loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+
+  if (off) {
+    return 0;
+  }
+
+  buf[0] = '0' + b3_data->read_mode;
+
+  return 1;
+}
+
+static ssize_t read_mode_write(struct file *filp, struct kobject *kobj,
+                               struct bin_attribute *bin_attr, char *buf,
+                               loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+
+  if (buf[0] < '0' + W1_DS2432_READ_PLAIN ||
+      buf[0] > '0' + W1_DS2432_READ_MAC) {
+    return -EINVAL;
+  }
+
+  w1_b3_lock(sl);
+  b3_data->read_mode = buf[0] - '0';
+  // Pages cached under a weaker mode must be read again.
+  w1_b3_invalidate_cache(sl);
+  w1_b3_unlock(sl);
+
+  return count;
+}
+
+static BIN_ATTR_RW(read_mode, 1);
+
+//
+// eeprom layout: '0' plain, '1' with an error correcting code in the last two
+// bytes of each page
+//
+
+static ssize_t ecc_read(struct file *filp, struct kobject *kobj,
+                        struct bin_attribute *bin_attr, char *buf, loff_t off,
+                        size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+
+  if (off) {
+    return 0;
+  }
+
+  buf[0] = b3_data->ecc ? '1' : '0';
+
+  return 1;
+}
+
+static ssize_t ecc_write(struct file *filp, struct kobject *kobj,
+                         struct bin_attribute *bin_attr, char *buf, loff_t off,
+                         size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+
+  if (buf[0] != '0' && buf[0] != '1') {
+    return -EINVAL;
+  }
+
+  w1_b3_lock(sl);
+  b3_data->ecc = buf[0] == '1';
+  // Cached pages were not checked against their code.
+  w1_b3_invalidate_cache(sl);
+  w1_b3_unlock(sl);
+
+  return count;
+}
+
+static BIN_ATTR_RW(ecc, 1);
+
+// How the code fared, as little-endian 32-bit counters: single bit errors
+// corrected, pages read again for uncorrectable errors, pages that stayed
+// uncorrectable. Writing anything resets them.
+static ssize_t ecc_stats_read(struct file *filp, struct kobject *kobj,
+                              struct bin_attribute *bin_attr, char *buf,
+                              loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+  __le32 stats[3];
+
+  if ((count = w1_b3_fix_count(off, count, sizeof(stats))) == 0) {
+    return 0;
+  }
+
+  w1_b3_lock(sl);
+  stats[0] = cpu_to_le32(b3_data->ecc_corrected);
+  stats[1] = cpu_to_le32(b3_data->ecc_rereads);
+  stats[2] = cpu_to_le32(b3_data->ecc_failed);
+  w1_b3_unlock(sl);
+
+  memcpy(buf, (u8 *)stats + off, count);
+
+  return count;
+}
+
+static ssize_t ecc_stats_write(struct file *filp, struct kobject *kobj,
+                               struct bin_attribute *bin_attr, char *buf,
+                               loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+
+  w1_b3_lock(sl);
+  b3_data->ecc_corrected = 0;
+  b3_data->ecc_rereads = 0;
+  b3_data->ecc_failed = 0;
+  w1_b3_unlock(sl);
+
+  return count;
+}
+
+static BIN_ATTR_RW(ecc_stats, 3 * sizeof(__le32));
+
+//
+// Link policy
+//
+// Reading gives the link level in effect and its parameters, then the slave's
+// and the master's window: samples, and commands that hit a presence, CRC and
+// status error. Writing a level pins it, "auto" goes back to the windows.
+//
+
+static size_t w1_ds2432_link_print(char *text, size_t size, const char *name,
+                                   const struct w1_ds2432_link *link) {
+  return scnprintf(text, size, "%s %u %u %u %u\n", name, link->samples,
+                   hweight64(link->window[W1_DS2432_LINK_PRESENCE]),
+                   hweight64(link->window[W1_DS2432_LINK_CRC]),
+                   hweight64(link->window[W1_DS2432_LINK_STATUS]));
+}
+
+static ssize_t link_policy_read(struct file *filp, struct kobject *kobj,
+                                struct bin_attribute *bin_attr, char *buf,
+                                loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+  const struct w1_ds2432_link_policy *policy;
+  enum w1_ds2432_link_level level;
+  char text[256];
+  size_t len;
+
+  w1_b3_lock(sl);
+  level = w1_b3_link_level(sl);
+  policy = &w1_ds2432_link_policies[level];
+
+  len = scnprintf(text, sizeof(text),
+                  "level %s%s\nread_retries %u\npresence_retries %u\n"
+                  "read_mode %u\ncrc_check %u\nmargin_ms %u\n",
+                  w1_ds2432_link_levels[level],
+                  b3_data->link_pin == W1_DS2432_LINK_AUTO ? "" : " (pinned)",
+                  policy->read_retries, policy->presence_retries,
+                  max(b3_data->read_mode, policy->read_mode),
+                  policy->crc_check || crc_check, policy->margin_ms);
+  len += w1_ds2432_link_print(text + len, sizeof(text) - len, "slave",
+                              &b3_data->link);
+  if (b3_data->bus) {
+    len += w1_ds2432_link_print(text + len, sizeof(text) - len, "master",
+                                &b3_data->bus->link);
+  }
+  w1_b3_unlock(sl);
+
+  if ((count = w1_b3_fix_count(off, count, len)) > 0) {
+    memcpy(buf, text + off, count);
+  }
+
+  return count;
+}
+
+static ssize_t link_policy_write(struct file *filp, struct kobject *kobj,
+                                 struct bin_attribute *bin_attr, char *buf,
+                                 loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+  char command[16];
+  int level;
+
+  if (count >= sizeof(command)) {
+    return -EINVAL;
+  }
+
+  memcpy(command, buf, count);
+  command[count] = '\0';
+
+  level = match_string(w1_ds2432_link_levels,
+                       ARRAY_SIZE(w1_ds2432_link_levels), strim(command));
+  if (level < 0) {
+    return -EINVAL;
+  }
+
+  w1_b3_lock(sl);
+  b3_data->link_pin = level;
+  w1_b3_unlock(sl);
+
+  return count;
+}
+
+static BIN_ATTR_RW(link_policy, 0);
+
+//
+// Cached image export/import
+//
+// Reading gives a struct w1_ds2432_cache_record with every trusted page.
+// Writing one back (e.g. at boot) seeds the pages that are not cached yet;
+// they are confirmed by a single spot check before the first read serves them.
+// Both need the cache parameter: without it, every batch starts by dropping
+// the image.
+//
+
+static ssize_t cache_image_read(struct file *filp, struct kobject *kobj,
+                                struct bin_attribute *bin_attr, char *buf,
+                                loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+  struct w1_ds2432_cache_record record = {{0}};
+  int page;
+
+  if (!READ_ONCE(cache)) {
+    return -EOPNOTSUPP;
+  }
+
+  if ((count = w1_b3_fix_count(off, count, sizeof(record))) == 0) {
+    return 0;
+  }
+
+  memcpy(record.magic, W1_DS2432_CACHE_MAGIC, sizeof(record.magic));
+  memcpy(record.registration_number, b3_data->registration_number,
+         sizeof(record.registration_number));
+
+  w1_b3_lock(sl);
+  for (page = 0; page < W1_DS2432_PAGE_COUNT; page++) {
+    if (b3_data->page_state[page] != W1_DS2432_PAGE_TRUSTED) {
+      continue;
+    }
+
+    record.page_valid |= BIT(page);
+    memcpy(&record.image[page * W1_DS2432_PAGE_SIZE],
+           &b3_data->image[page * W1_DS2432_PAGE_SIZE], W1_DS2432_PAGE_SIZE);
+  }
+  w1_b3_unlock(sl);
+
+  memcpy(buf, (u8 *)&record + off, count);
+
+  return count;
+}
+
+static ssize_t cache_image_write(struct file *filp, struct kobject *kobj,
+                                 struct bin_attribute *bin_attr, char *buf,
+                                 loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+  const struct w1_ds2432_cache_record *record = (const void *)buf;
+  int page;
+
+  if (!READ_ONCE(cache)) {
+    return -EOPNOTSUPP;
+  }
+
+  if (off != 0 || count != sizeof(*record) ||
+      memcmp(record->magic, W1_DS2432_CACHE_MAGIC, sizeof(record->magic))) {
+    return -EINVAL;
+  }
+
+  if (memcmp(record->registration_number, b3_data->registration_number,
+             sizeof(record->registration_number))) {
+    // ENODEV: the image belongs to another device.
+    return -ENODEV;
+  }
+
+  w1_b3_lock(sl);
+  for (page = 0; page < W1_DS2432_PAGE_COUNT; page++) {
+    if (!(record->page_valid & BIT(page)) ||
+        b3_data->page_state[page] != W1_DS2432_PAGE_EMPTY) {
+      continue;
+    }
+
+    memcpy(&b3_data->image[page * W1_DS2432_PAGE_SIZE],
+           &record->image[page * W1_DS2432_PAGE_SIZE], W1_DS2432_PAGE_SIZE);
+    b3_data->page_state[page] = W1_DS2432_PAGE_UNVERIFIED;
+  }
+  w1_b3_unlock(sl);
+
+  return count;
+}
+
+static BIN_ATTR_RW(cache_image, sizeof(struct w1_ds2432_cache_record));
+
+//
+// SECRET MEMORY
+//
+// 0080h to 0087h - No read access; secret not required for write access
+//
+
+static ssize_t secret_read(struct file *filp, struct kobject *kobj,
+                           struct bin_attribute *bin_attr, char *buf,
+                           loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+  ssize_t result = 8;
+
+  // Only a secret written here can be read back. Derived and table secrets
+  // would give away the master key or a secret shared by other devices, and
+  // keyring and rotated secrets never leave the kernel.
+  w1_b3_lock(sl);
+  if (b3_data->secret_source == W1_DS2432_SECRET_USER) {
+    memcpy(buf, b3_data->secret, 8);
+  } else {
+    result = -EPERM;
+  }
+  w1_b3_unlock(sl);
+
+  return result;
+}
+
+static ssize_t secret_write(struct file *filp, struct kobject *kobj,
+                            struct bin_attribute *bin_attr, char *buf,
+                            loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+
+  if (count < 8) {
+    return -EINVAL;
+  }
+
+  w1_b3_lock(sl);
+  w1_b3_drop_key(b3_data);
+  w1_b3_set_secret(b3_data, buf, W1_DS2432_SECRET_USER);
+  w1_b3_unlock(sl);
+
+  return count;
+}
+
+static BIN_ATTR_RW(secret, 8);
+
+//
+// Secret from the kernel keyring
+//
+// Write the description of a "logon" (preferred) or "user" key holding the
+// 8-byte secret. The key is resolved once; afterwards only its revocation or
+// update is checked, and a revoked key is resolved again by key_work. Write an
+// empty line to forget the key.
+//
+
+static ssize_t secret_key_read(struct file *filp, struct kobject *kobj,
+                               struct bin_attribute *bin_attr, char *buf,
+                               loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+  char desc[W1_DS2432_KEY_DESC_SIZE + 1] = "";
+  size_t len;
+
+  w1_b3_lock(sl);
+  if (b3_data->secret_key_desc) {
+    snprintf(desc, sizeof(desc), "%s\n", b3_data->secret_key_desc);
+  }
+  w1_b3_unlock(sl);
+
+  len = strlen(desc);
+  if ((count = w1_b3_fix_count(off, count, len)) == 0) {
+    return 0;
+  }
+
+  memcpy(buf, desc + off, count);
+
+  return count;
+}
+
+static ssize_t secret_key_write(struct file *filp, struct kobject *kobj,
+                                struct bin_attribute *bin_attr, char *buf,
+                                loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+  struct key *key = NULL;
+  char *desc;
+
+  if (count > W1_DS2432_KEY_DESC_SIZE) {
+    return -EINVAL;
+  }
+
+  desc = kstrndup(buf, count, GFP_KERNEL);
+  if (!desc) {
+    return -ENOMEM;
+  }
+  strim(desc);
+
+  if (desc[0]) {
+    // Resolve outside the bus_mutex, this may call out to userspace.
+    key = w1_ds2432_request_key(desc);
+    if (IS_ERR(key)) {
+      kfree(desc);
+      return PTR_ERR(key);
+    }
+  }
+
+  w1_b3_lock(sl);
+  w1_b3_drop_key(b3_data);
+  if (key) {
+    b3_data->secret_key = key;
+    b3_data->secret_key_desc = desc;
+    desc = NULL;
+    w1_b3_set_secret(b3_data, NULL, W1_DS2432_SECRET_KEY);
+    w1_b3_refresh_key(sl);
+  } else if (b3_data->secret_source == W1_DS2432_SECRET_KEY) {
+    w1_b3_set_secret(b3_data, NULL, W1_DS2432_SECRET_DEFAULT);
+  }
+  w1_b3_unlock(sl);
+
+  kfree(desc);
+
+  return count;
+}
+
+static BIN_ATTR_RW(secret_key, W1_DS2432_KEY_DESC_SIZE);
+
+static ssize_t secret_sync_read(struct file *filp, struct kobject *kobj,
+                                struct bin_attribute *bin_attr, char *buf,
+                                loff_t off, size_t count) {
+  // secret_sync is not readable.
+  return 0;
+}
+
+static ssize_t secret_sync_write(struct file *filp, struct kobject *kobj,
+                                 struct bin_attribute *bin_attr, char *buf,
+                                 loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  u8 secret[8];
+
+  w1_b3_lock(sl);
+
+  if (w1_ds2432_reset_select(sl) < 0) {
+    count = -ENODEV;
+    goto out_up;
+  }
+
+  memcpy(secret, w1_b3_secret(sl), sizeof(secret));
+  w1_ds2432_write_secret(sl, secret);
+  memzero_explicit(secret, sizeof(secret));
+
+out_up:
+  w1_b3_unlock(sl);
+
+  return count;
+}
+
+static BIN_ATTR_RW(secret_sync, 1);
+
+//
+// Authentication verdict
+//
+// '1' when the device proves it knows the secret, '0' otherwise. Served from
+// cache for auth_ttl_ms; invalidated on rewrite and on secret change.
+//
+
+static ssize_t authentic_read(struct file *filp, struct kobject *kobj,
+                              struct bin_attribute *bin_attr, char *buf,
+                              loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  int error;
+
+  if (off) {
+    return 0;
+  }
+
+  w1_b3_lock(sl);
+  error = w1_b3_authenticate(sl);
+  w1_b3_unlock(sl);
+
+  if (error < 0 && error != -EACCES) {
+    return error;
+  }
+
+  buf[0] = error ? '0' : '1';
+
+  return 1;
+}
+
+static BIN_ATTR_RO(authentic, 1);
+
+//
+// Authenticated image
+//
+// All four pages read with Read Authenticated Page back to back, each with its
+// own random challenge, in a single bus session. The MACs are verified off the
+// bus afterwards, and the record carries the challenges and device MACs so
+// that it can be checked again offline by whoever holds the secret.
+//
+
+struct w1_ds2432_audit_record {
+  u8 image[W1_DS2432_DATA_MEMORY_SIZE];
+  u8 challenge[W1_DS2432_PAGE_COUNT][3];
+  u8 mac[W1_DS2432_PAGE_COUNT][20]; // as sent by the device
+  u8 page_valid;                    // bit n set: page n MAC matches
+  u8 genuine;                       // 1: every page MAC matches
+} __packed;
+
+/**
+ * Read and authenticate the whole data memory.
+ *
+ * Returns 0 when every page is genuine, -EACCES when a MAC does not match,
+ * another negative error when the memory could not be read. Genuine pages go
+ * to the cache and the verdict to the authentication cache.
+ */
+static int w1_b3_authenticate_device(struct w1_slave *sl,
+                                     struct w1_ds2432_audit_record *record) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  u8 secret[8];
+  u8 host_mac[20];
+  struct sha1 mac;
+  unsigned int image_gen;
+  unsigned int retries;
+  unsigned int attempt;
+  int page;
+  int error = 0;
+
+  memset(record, 0, sizeof(*record));
+  get_random_bytes(record->challenge, sizeof(record->challenge));
+
+  w1_b3_lock(sl);
+  memcpy(secret, w1_b3_secret(sl), sizeof(secret));
+  retries = w1_b3_link_policy(sl)->read_retries;
+  for (page = 0; page < W1_DS2432_PAGE_COUNT && error == 0; page++) {
+    for (attempt = 0; attempt < retries; attempt++) {
+      error = w1_ds2432_read_authenticated_page(
+          sl, page, record->challenge[page],
+          &record->image[page * W1_DS2432_PAGE_SIZE], record->mac[page]);
+      if (error != -EIO) {
+        break;
+      }
+    }
+  }
+  image_gen = b3_data->image_gen;
+  w1_b3_unlock(sl);
+
+  if (error < 0) {
+    goto out;
+  }
+
+  for (page = 0; page < W1_DS2432_PAGE_COUNT; page++) {
+    generate_auth_mac(secret, record->challenge[page], page,
+                      &record->image[page * W1_DS2432_PAGE_SIZE],
+                      b3_data->registration_number, &mac);
+    w1_ds2432_mac_to_bytes(&mac, host_mac);
+
+    if (!memcmp(host_mac, record->mac[page], sizeof(host_mac))) {
+      record->page_valid |= BIT(page);
+    }
+  }
+
+  record->genuine = record->page_valid == BIT(W1_DS2432_PAGE_COUNT) - 1;
+  // EACCES: a page MAC is invalid, wrong secret or device not genuine.
+  error = record->genuine ? 0 : -EACCES;
+
+  w1_b3_lock(sl);
+  // Unless something was written in the meantime, the pages are current.
+  if (b3_data->image_gen == image_gen) {
+    for (page = 0; page < W1_DS2432_PAGE_COUNT; page++) {
+      if (!(record->page_valid & BIT(page))) {
+        continue;
+      }
+      memcpy(&b3_data->image[page * W1_DS2432_PAGE_SIZE],
+             &record->image[page * W1_DS2432_PAGE_SIZE], W1_DS2432_PAGE_SIZE);
+      b3_data->page_state[page] = W1_DS2432_PAGE_TRUSTED;
+    }
+    b3_data->image_gen++;
+  }
+  b3_data->auth_valid = true;
+  b3_data->auth_verdict = error;
+  b3_data->auth_stamp = jiffies;
+  w1_b3_unlock(sl);
+
+out:
+  memzero_explicit(secret, sizeof(secret));
+
+  return error;
+}
+
+// Each read from offset 0 takes a new dump; read the record in one go.
+static ssize_t authenticated_image_read(struct file *filp, struct kobject *kobj,
+                                        struct bin_attribute *bin_attr,
+                                        char *buf, loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_ds2432_audit_record record;
+  int error;
+
+  if (off) {
+    return 0;
+  }
+
+  error = w1_b3_authenticate_device(sl, &record);
+  if (error < 0 && error != -EACCES) {
+    return error;
+  }
+
+  count = min(count, sizeof(record));
+  memcpy(buf, &record, count);
+
+  return count;
+}
+
+static BIN_ATTR_RO(authenticated_image, sizeof(struct w1_ds2432_audit_record));
+
+//
+// REGISTER PAGE
+//
+// 0088h Write-protect secret, 008Ch to 008Fh - Protection activated by code AAh
+// or 55h 0089h Write-protect pages 0 to 3 - Protection activated by code AAh or
+// 55h 008Ah User byte, self-protecting - Protection activated by code AAh or
+// 55h 008Bh Factory byte (read only) - Reads either AAh or 55h 008Ch User
+// byte/EPROM mode control for page 1Mode - activated by code AAh or 55h 008Dh
+// User byte/Write-protect page 0 only - Protection activated by code AAh or 55h
+// 008Eh to 008Fh User Bytes/Manufacturer ID - Function depends on factory byte
+// 0090h to 0097h 64-Bit Registration Number (Alternate readout)
+//
+
+static inline bool w1_ds2432_is_protect_code(u8 value) {
+  return value == 0xAA || value == 0x55;
+}
+
+// Read the whole register page (0088h to 0097h) in a single Read Memory.
+static int w1_ds2432_read_register_page(struct w1_slave *sl, u8 *regs) {
+  return w1_ds2432_read_memory(sl, W1_DS2432_REGISTER_PAGE_ADDR, regs,
+                               W1_DS2432_REGISTER_PAGE_SIZE);
+}
+
+// Whether the register at `reg` can no longer be changed, given a snapshot of
+// the register page.
+static bool w1_ds2432_register_locked(const u8 *regs, u8 reg) {
+  switch (reg) {
+  case W1_DS2432_REG_FACTORY_BYTE:
+    return true;
+  case W1_DS2432_REG_MANUFACTURER_ID:
+  case W1_DS2432_REG_MANUFACTURER_ID + 1:
+    // The factory byte reads AAh when 008Eh/008Fh hold a manufacturer ID.
+    return regs[W1_DS2432_REG_FACTORY_BYTE] == 0xAA;
+  default:
+    // 0088h to 008Dh are locked once they hold a protection code.
+    return w1_ds2432_is_protect_code(regs[reg]);
+  }
+}
+
+/**
+ * Program any combination of the writable register page bytes (0088h to
+ * 008Fh) in a single authenticated copy cycle.
+ *
+ * values: W1_DS2432_REG_WRITABLE_SIZE bytes, indexed by register offset
+ * mask: bit n set means register offset n must be set to values[n]
+ *
+ * Registers already holding the requested value are left alone, so a request
+ * that changes nothing costs a single register page read. The result is
+ * verified against one fresh register page snapshot.
+ *
+ * The caller must hold the bus_mutex.
+ */
+static int w1_ds2432_program_registers(struct w1_slave *sl, const u8 *values,
+                                       u8 mask) {
+  u8 regs[W1_DS2432_REGISTER_PAGE_SIZE];
+  u8 block[W1_DS2432_REG_WRITABLE_SIZE];
+  bool changed = false;
+  int error = 0;
+  u8 reg;
+
+  error = w1_ds2432_read_register_page(sl, regs);
+  if (error < 0) {
+    return error;
+  }
+
+  memcpy(block, regs, sizeof(block));
+
+  for (reg = 0; reg < W1_DS2432_REG_WRITABLE_SIZE; reg++) {
+    if (!(mask & BIT(reg)) || regs[reg] == values[reg]) {
+      continue;
+    }
+
+    if (w1_ds2432_register_locked(regs, reg)) {
+      dev_err(&sl->dev, "register %04x is locked (%02x)\n",
+              W1_DS2432_REGISTER_PAGE_ADDR + reg, regs[reg]);
+      // EPERM: the register can not be changed anymore.
+      return -EPERM;
+    }
+
+    block[reg] = values[reg];
+    changed = true;
+  }
+
+  if (!changed) {
+    return 0;
+  }
+
+  error = eeprom_write_block(sl, W1_DS2432_REGISTER_PAGE_ADDR, block);
+  if (error < 0) {
+    return error;
+  }
+
+  error = w1_ds2432_read_register_page(sl, regs);
+  if (error < 0) {
+    return error;
+  }
+
+  if (memcmp(regs, block, sizeof(block))) {
+    dev_err(&sl->dev, "register page does not match after programming\n");
+    // EIO: the copy was accepted but the data did not make it.
+    return -EIO;
+  }
+
+  return 0;
+}
+
+/*
+ * Register page regmap.
+ *
+ * Registers are the 16 bytes of the register page, numbered by their offset
+ * from 0088h, and cached flat: reads are served from the cache, which is
+ * loaded with a single Read Memory, and a raw write of consecutive registers
+ * costs one authenticated copy cycle. The registers only change through this
+ * driver, so none of them is volatile.
+ *
+ * Every regmap call is made with the bus_mutex held, which the bus callbacks
+ * below rely on.
+ */
+
+static int w1_ds2432_regmap_read(void *context, const void *reg_buf,
+                                 size_t reg_size, void *val_buf,
+                                 size_t val_size) {
+  struct w1_slave *sl = context;
+  u8 reg = *(const u8 *)reg_buf;
+
+  return w1_ds2432_read_memory(sl, W1_DS2432_REGISTER_PAGE_ADDR + reg, val_buf,
+                               val_size);
+}
+
+static int w1_ds2432_regmap_write(void *context, const void *data,
+                                  size_t count) {
+  struct w1_slave *sl = context;
+  const u8 *bytes = data;
+  u8 values[W1_DS2432_REG_WRITABLE_SIZE] = {0};
+  u8 reg = bytes[0];
+  u8 mask = 0;
+  size_t i;
+
+  for (i = 1; i < count; i++, reg++) {
+    if (reg >= W1_DS2432_REG_WRITABLE_SIZE) {
+      // EPERM: the registration number is read only.
+      return -EPERM;
+    }
+
+    values[reg] = bytes[i];
+    mask |= BIT(reg);
+  }
+
+  return w1_ds2432_program_registers(sl, values, mask);
+}
+
+static const struct regmap_bus w1_ds2432_regmap_bus = {
+    .read = w1_ds2432_regmap_read,
+    .write = w1_ds2432_regmap_write,
+};
+
+static const struct regmap_config w1_ds2432_regmap_config = {
+    .name = "register_page",
+    .reg_bits = 8,
+    .val_bits = 8,
+    .max_register = W1_DS2432_REGISTER_PAGE_SIZE - 1,
+    .cache_type = REGCACHE_FLAT,
+};
+
+// Load the regmap cache from the device. The caller must hold the bus_mutex.
+static int w1_ds2432_regmap_refresh(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  u8 regs[W1_DS2432_REGISTER_PAGE_SIZE];
+  int error;
+
+  error = w1_ds2432_read_register_page(sl, regs);
+  if (error < 0) {
+    return error;
+  }
+
+  regcache_cache_only(b3_data->regmap, true);
+  error = regmap_raw_write(b3_data->regmap, 0, regs, sizeof(regs));
+  regcache_cache_only(b3_data->regmap, false);
+
+  b3_data->regs_valid = error == 0;
+
+  return error;
+}
+
+// Copy `count` registers starting at `reg` from the cache, loading it first
+// if needed. The caller must hold the bus_mutex.
+static int w1_ds2432_register_get(struct w1_slave *sl, u8 reg, u8 *buf,
+                                  size_t count) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  int error;
+
+  if (!b3_data->regs_valid) {
+    error = w1_ds2432_regmap_refresh(sl);
+    if (error < 0) {
+      return error;
+    }
+  }
+
+  return regmap_bulk_read(b3_data->regmap, reg, buf, count);
+}
+
+// Write `count` raw bytes starting at register offset `reg`, in one copy cycle.
+static ssize_t w1_ds2432_register_write(struct w1_slave *sl, u8 reg,
+                                        const char *buf, size_t count) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  u8 current_values[W1_DS2432_REG_WRITABLE_SIZE];
+  int error;
+
+  if ((count = w1_b3_fix_count(reg, count, W1_DS2432_REG_WRITABLE_SIZE)) ==
+      0) {
+    return -EINVAL;
+  }
+
+  w1_b3_lock(sl);
+
+  // Nothing to do when the registers already hold these values.
+  error = w1_ds2432_register_get(sl, reg, current_values, count);
+  if (error == 0 && memcmp(current_values, buf, count)) {
+    error = regmap_raw_write(b3_data->regmap, reg, buf, count);
+    if (error < 0) {
+      // The cache took the new values whether or not they made it.
+      b3_data->regs_valid = false;
+    }
+  }
+
+  w1_b3_unlock(sl);
+
+  return error < 0 ? error : count;
+}
+
+// Activate the protection register at `reg`. Accepts '1' (programs AAh) or a
+// raw protection code (AAh or 55h).
+static ssize_t w1_ds2432_protect_write(struct w1_slave *sl, u8 reg,
+                                       const char *buf, size_t count) {
+  u8 code = buf[0];
+  ssize_t result;
+
+  if (count < 1) {
+    return -EINVAL;
+  }
+
+  if (code == '1') {
+    code = W1_DS2432_PROTECT_CODE;
+  } else if (!w1_ds2432_is_protect_code(code)) {
+    return -EINVAL;
+  }
+
+  result = w1_ds2432_register_write(sl, reg, &code, 1);
+
+  return result < 0 ? result : count;
+}
+
+/*
+ * Register page attributes. They all share the handlers below, with the
+ * register offset of the attribute in its `private` field.
+ */
+
+#define W1_DS2432_REGISTER_ATTR(_name, _mode, _reg, _size, _read, _write)     \
+  static struct bin_attribute bin_attr_##_name = {                            \
+      .attr = {.name = #_name, .mode = _mode},                                \
+      .size = _size,                                                          \
+      .private = (void *)(_reg),                                              \
+      .read = _read,                                                          \
+      .write = _write,                                                        \
+  }
+
+// Raw register bytes.
+static ssize_t w1_ds2432_register_attr_read(struct file *filp,
+                                            struct kobject *kobj,
+                                            struct bin_attribute *bin_attr,
+                                            char *buf, loff_t off,
+                                            size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  u8 reg = (unsigned long)bin_attr->private;
+  int error;
+
+  if ((count = w1_b3_fix_count(off, count, bin_attr->size)) == 0) {
+    return 0;
+  }
+
+  w1_b3_lock(sl);
+  error = w1_ds2432_register_get(sl, reg + off, buf, count);
+  w1_b3_unlock(sl);
+
+  return error < 0 ? error : count;
+}
+
+static ssize_t w1_ds2432_register_attr_write(struct file *filp,
+                                             struct kobject *kobj,
+                                             struct bin_attribute *bin_attr,
+                                             char *buf, loff_t off,
+                                             size_t count) {
+  u8 reg = (unsigned long)bin_attr->private;
+
+  return w1_ds2432_register_write(kobj_to_w1_slave(kobj), reg + off, buf,
+                                  count);
+}
+
+// Protection registers: '1' when the protection is active, '0' otherwise.
+static ssize_t w1_ds2432_protect_attr_read(struct file *filp,
+                                           struct kobject *kobj,
+                                           struct bin_attribute *bin_attr,
+                                           char *buf, loff_t off,
+                                           size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  u8 reg = (unsigned long)bin_attr->private;
+  u8 value;
+  int error;
+
+  if (off > 0 || count < 1) {
+    return 0;
+  }
+
+  w1_b3_lock(sl);
+  error = w1_ds2432_register_get(sl, reg, &value, 1);
+  w1_b3_unlock(sl);
+
+  if (error < 0) {
+    return error;
+  }
+
+  buf[0] = w1_ds2432_is_protect_code(value) ? '1' : '0';
+
+  return 1;
+}
+
+static ssize_t w1_ds2432_protect_attr_write(struct file *filp,
+                                            struct kobject *kobj,
+                                            struct bin_attribute *bin_attr,
+                                            char *buf, loff_t off,
+                                            size_t count) {
+  u8 reg = (unsigned long)bin_attr->private;
+
+  return w1_ds2432_protect_write(kobj_to_w1_slave(kobj), reg, buf, count);
+}
+
+// Writing the register page programs bytes 0088h to 008Fh (offsets 0 to 7) in
+// one copy cycle, e.g. protecting pages 0-3 and the secret and setting the
+// user byte at once. The factory byte (offset 3) is read only; pass its
+// current value or split the write around it.
+W1_DS2432_REGISTER_ATTR(register_page, 0644, 0, W1_DS2432_REGISTER_PAGE_SIZE,
+                        w1_ds2432_register_attr_read,
+                        w1_ds2432_register_attr_write);
+
+// 0088h Write-protect secret - Protection activated by code AAh or 55h. Reads
+// the raw register byte, as it always has.
+W1_DS2432_REGISTER_ATTR(write_protect_secret, 0644, W1_DS2432_REG_WP_SECRET, 1,
+                        w1_ds2432_register_attr_read,
+                        w1_ds2432_protect_attr_write);
+
+// 0089h Write-protect pages 0 to 3 - Protection activated by code AAh or 55h
+W1_DS2432_REGISTER_ATTR(write_protect_pages_03, 0644,
+                        W1_DS2432_REG_WP_PAGES_03, 1,
+                        w1_ds2432_protect_attr_read,
+                        w1_ds2432_protect_attr_write);
+
+// 008Ah User byte, self-protecting - Protection activated by code AAh or 55h
+W1_DS2432_REGISTER_ATTR(user_byte, 0644, W1_DS2432_REG_USER_BYTE, 1,
+                        w1_ds2432_register_attr_read,
+                        w1_ds2432_register_attr_write);
+
+// 008Bh Factory byte (read only) - Reads either AAh or 55h
+W1_DS2432_REGISTER_ATTR(factory_byte, 0444, W1_DS2432_REG_FACTORY_BYTE, 1,
+                        w1_ds2432_register_attr_read, NULL);
+
+// 008Ch User byte/EPROM mode control for page 1 - Mode activated by code AAh or
+// 55h
+W1_DS2432_REGISTER_ATTR(eprom_mode_page_1, 0644, W1_DS2432_REG_EPROM_PAGE_1, 1,
+                        w1_ds2432_protect_attr_read,
+                        w1_ds2432_protect_attr_write);
+
+// 008Dh User byte/Write-protect page 0 only - Protection activated by code AAh
+// or 55h
+W1_DS2432_REGISTER_ATTR(write_protect_page_0, 0644, W1_DS2432_REG_WP_PAGE_0, 1,
+                        w1_ds2432_protect_attr_read,
+                        w1_ds2432_protect_attr_write);
+
+// 008Eh to 008Fh User Bytes/Manufacturer ID - Function depends on factory byte
+W1_DS2432_REGISTER_ATTR(manufacturer_id, 0644, W1_DS2432_REG_MANUFACTURER_ID,
+                        2, w1_ds2432_register_attr_read,
+                        w1_ds2432_register_attr_write);
+
+// 0090h to 0097h 64-Bit Registration Number (Alternate readout)
+W1_DS2432_REGISTER_ATTR(registration_number, 0444,
+                        W1_DS2432_REG_REGISTRATION_NUM, 8,
+                        w1_ds2432_register_attr_read, NULL);
+
+//
+// Secret rotation
+//
+// A rotation job (see the rotate module parameter) gives every slave in its
+// device set a new secret, and only trusts it once the device authenticates
+// with it. Each slave keeps a journal entry for the job, exported and
+// imported through the rotation attribute, so that a job submitted again
+// after an interruption skips the slaves already done and settles the ones
+// caught in the middle.
+//
+// The journal and the rotated secrets only live in memory: a slave detach, a
+// module reload or a reboot loses them. Keeping them across those is up to
+// userspace, see the README.
+//
+
+enum w1_ds2432_rotation_rule {
+  W1_DS2432_ROTATE_SECRET = 0, // Load First Secret, the same for every device
+  W1_DS2432_ROTATE_DERIVE,     // Load First Secret, derived from a master key
+  W1_DS2432_ROTATE_NEXT,       // Compute Next Secret over a page
+};
+
+struct w1_ds2432_rotation {
+  u32 id;
+  enum w1_ds2432_rotation_rule rule;
+  u8 value[8]; // secret, master key or partial secret, as the rule says
+  u8 page;     // Compute Next Secret target page
+  // Device set, as for secret table entries; match_len 0 takes every device.
+  u8 match[8];
+  u8 match_len;
+  bool manufacturer_id;
+
+  // Progress, protected by w1_ds2432_rotation_lock except for the counters.
+  bool running;
+  bool cancel;
+  atomic_t workers;
+  atomic_t total;
+  atomic_t rotated;
+  atomic_t skipped;
+  atomic_t failed;
+};
+
+// Authenticate page 0 with `secret`, as many times as the link allows. The
+// caller must hold the bus_mutex.
+static int w1_b3_rotation_verify(struct w1_slave *sl, const u8 *secret) {
+  unsigned int retries = w1_b3_link_policy(sl)->read_retries;
+  unsigned int attempt;
+  int error = -EIO;
+
+  for (attempt = 0; attempt < retries && error == -EIO; attempt++) {
+    error = w1_ds2432_authenticate_page(sl, secret, 0, NULL);
+  }
+
+  return error;
+}
+
+/**
+ * Rotate one slave's secret as `job` says.
+ *
+ * The slave must hold the secret the driver has for it; the new one is sent,
+ * verified with an authenticated read and then replaces it. A slave caught
+ * between the two by an interruption is checked against the new secret first.
+ *
+ * Returns 1 when rotated, 0 when the slave already was, -ENOENT when it is not
+ * in the job's device set, another negative error when the rotation failed.
+ */
+static int w1_b3_rotate(struct w1_slave *sl,
+                        const struct w1_ds2432_rotation *job) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  u8 page_data[W1_DS2432_PAGE_SIZE];
+  u8 manufacturer_id[2];
+  const u8 *id = b3_data->registration_number;
+  u8 secret[8];
+  u8 target[8];
+  bool resume;
+  int error = 0;
+
+  // Host computation first, off the bus when it does not need the device.
+  if (job->rule == W1_DS2432_ROTATE_SECRET) {
+    memcpy(target, job->value, sizeof(target));
+  } else if (job->rule == W1_DS2432_ROTATE_DERIVE) {
+    w1_ds2432_derive_secret(job->value, b3_data->registration_number, target);
+  }
+
+  w1_b3_lock(sl);
+
+  resume = b3_data->rotation_job == job->id;
+  if (resume && b3_data->rotation_state == W1_DS2432_ROTATION_DONE) {
+    goto out;
+  }
+
+  if (job->manufacturer_id) {
+    error = w1_ds2432_register_get(sl, W1_DS2432_REG_MANUFACTURER_ID,
+                                   manufacturer_id, sizeof(manufacturer_id));
+    if (error < 0) {
+      goto out;
+    }
+    id = manufacturer_id;
+  }
+
+  if (memcmp(job->match, id, job->match_len)) {
+    error = -ENOENT;
+    goto out;
+  }
+
+  memcpy(secret, w1_b3_secret(sl), sizeof(secret));
+
+  if (job->rule == W1_DS2432_ROTATE_NEXT) {
+    // The page goes into the new secret; reading it authenticated also tells
+    // whether the device still has the old one.
+    error = w1_ds2432_authenticate_page(sl, secret, job->page, page_data);
+    if (error < 0 && error != -EACCES) {
+      goto fail;
+    }
+    w1_ds2432_next_secret(secret, page_data, job->value, target);
+  }
+
+  if (resume && b3_data->rotation_state == W1_DS2432_ROTATION_ISSUED &&
+      w1_b3_rotation_verify(sl, target) == 0) {
+    goto done;
+  }
+
+  // EACCES: the device does not have the secret the new one derives from.
+  if (error == -EACCES) {
+    b3_data->rotation_job = job->id;
+    b3_data->rotation_state = W1_DS2432_ROTATION_FAILED;
+    goto fail;
+  }
+
+  b3_data->rotation_job = job->id;
+  b3_data->rotation_state = W1_DS2432_ROTATION_ISSUED;
+
+  if (job->rule == W1_DS2432_ROTATE_NEXT) {
+    error = w1_ds2432_compute_next_secret(sl, job->page, job->value);
+  } else {
+    error = w1_ds2432_write_secret(sl, target);
+  }
+  if (error < 0) {
+    // Whether the device took it is found out on the next attempt.
+    goto fail;
+  }
+
+  error = w1_b3_rotation_verify(sl, target);
+  if (error == -EACCES) {
+    b3_data->rotation_state = W1_DS2432_ROTATION_FAILED;
+  }
+  if (error < 0) {
+    goto fail;
+  }
+
+done:
+  w1_b3_drop_key(b3_data);
+  w1_b3_set_secret(b3_data, target, W1_DS2432_SECRET_ROTATED);
+  b3_data->rotation_job = job->id;
+  b3_data->rotation_state = W1_DS2432_ROTATION_DONE;
+  b3_data->rotation_error = 0;
+  error = 1;
+  goto out;
+
+fail:
+  dev_warn(&sl->dev, "secret rotation %u failed (%d)\n", job->id, error);
+  if (b3_data->rotation_job != job->id) {
+    // Failed before anything was sent.
+    b3_data->rotation_job = job->id;
+    b3_data->rotation_state = W1_DS2432_ROTATION_NONE;
+  }
+  b3_data->rotation_error = error;
+
+out:
+  w1_b3_unlock(sl);
+
+  memzero_explicit(secret, sizeof(secret));
+  memzero_explicit(target, sizeof(target));
+
+  return error;
+}
+
+static ssize_t rotation_read(struct file *filp, struct kobject *kobj,
+                             struct bin_attribute *bin_attr, char *buf,
+                             loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+  struct w1_ds2432_rotation_record record = {0};
+
+  if ((count = w1_b3_fix_count(off, count, sizeof(record))) == 0) {
+    return 0;
+  }
+
+  memcpy(record.magic, W1_DS2432_ROTATION_MAGIC, sizeof(record.magic));
+  memcpy(record.registration_number, b3_data->registration_number,
+         sizeof(record.registration_number));
+
+  w1_b3_lock(sl);
+  record.job = cpu_to_le32(b3_data->rotation_job);
+  record.state = b3_data->rotation_state;
+  record.error = cpu_to_le32(-b3_data->rotation_error);
+  w1_b3_unlock(sl);
+
+  memcpy(buf, (u8 *)&record + off, count);
+
+  return count;
+}
+
+static ssize_t rotation_write(struct file *filp, struct kobject *kobj,
+                              struct bin_attribute *bin_attr, char *buf,
+                              loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+  const struct w1_ds2432_rotation_record *record = (const void *)buf;
+
+  if (off != 0 || count != sizeof(*record)) {
+    return -EINVAL;
+  }
+
+  if (memcmp(record->magic, W1_DS2432_ROTATION_MAGIC, sizeof(record->magic)) ||
+      record->state > W1_DS2432_ROTATION_FAILED) {
+    return -EINVAL;
+  }
+
+  // ENXIO: the entry belongs to another device.
+  if (memcmp(record->registration_number, b3_data->registration_number,
+             sizeof(record->registration_number))) {
+    return -ENXIO;
+  }
+
+  w1_b3_lock(sl);
+  b3_data->rotation_job = le32_to_cpu(record->job);
+  b3_data->rotation_state = record->state;
+  b3_data->rotation_error = -(int)le32_to_cpu(record->error);
+  w1_b3_unlock(sl);
+
+  return count;
+}
+
+static BIN_ATTR_RW(rotation, sizeof(struct w1_ds2432_rotation_record));
+
+//
+// Transaction log
+//
+// Every command sent to the slave while the `trace` module parameter is set,
+// oldest first, as struct w1_ds2432_trace_record. Writing anything clears it.
+//
+
+static ssize_t transaction_log_read(struct file *filp, struct kobject *kobj,
+                                    struct bin_attribute *bin_attr, char *buf,
+                                    loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+  const size_t record_size = sizeof(struct w1_ds2432_trace_record);
+  unsigned int first, index;
+  size_t done = 0;
+
+  w1_b3_lock(sl);
+
+  count = w1_b3_fix_count(off, count, b3_data->trace_count * record_size);
+
+  first = (b3_data->trace_head + W1_DS2432_TRACE_DEPTH -
+           b3_data->trace_count) %
+          W1_DS2432_TRACE_DEPTH;
+
+  while (done < count) {
+    size_t pos = off + done;
+    size_t skip = pos % record_size;
+    size_t chunk = min(record_size - skip, count - done);
+
+    index = (first + pos / record_size) % W1_DS2432_TRACE_DEPTH;
+    memcpy(buf + done, (u8 *)&b3_data->trace[index] + skip, chunk);
+    done += chunk;
+  }
+
+  w1_b3_unlock(sl);
+
+  return count;
+}
+
+static ssize_t transaction_log_write(struct file *filp, struct kobject *kobj,
+                                     struct bin_attribute *bin_attr, char *buf,
+                                     loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+
+  w1_b3_lock(sl);
+  b3_data->trace_head = 0;
+  b3_data->trace_count = 0;
+  w1_b3_unlock(sl);
+
+  return count;
+}
+
+static BIN_ATTR_RW(transaction_log, W1_DS2432_TRACE_DEPTH *
+                                        sizeof(struct w1_ds2432_trace_record));
+
+//
+// Field schema
+//
+// A schema names fields of the data memory (name, offset, length, type). Each
+// field of the schema in effect for a slave is exposed as an attribute of its
+// "fields" directory, read from the cache and written through the request
+// queue, so that only the blocks a field covers are copied.
+//
+// Schemas are set per manufacturer ID through the field_schema module
+// parameter, or per slave through the field_schema attribute, which then
+// takes precedence.
+//
+
+struct w1_ds2432_field_schema_entry {
+  u8 manufacturer_id[2];
+  struct w1_ds2432_field field;
+};
+
+#define W1_DS2432_FIELD_SCHEMA_SIZE     64
+
+static struct w1_ds2432_field_schema_entry
+    w1_ds2432_field_schema[W1_DS2432_FIELD_SCHEMA_SIZE];
+static unsigned int w1_ds2432_field_schema_len;
+static DEFINE_MUTEX(w1_ds2432_field_schema_lock);
+
+static const char *const w1_ds2432_field_types[] = {
+    [W1_DS2432_FIELD_U8] = "u8",   [W1_DS2432_FIELD_U16] = "u16",
+    [W1_DS2432_FIELD_U32] = "u32", [W1_DS2432_FIELD_STR] = "str",
+    [W1_DS2432_FIELD_RAW] = "raw", [W1_DS2432_FIELD_COUNTER] = "counter",
+};
+
+// Parse "<name>,<offset>,<length>,<type>" (offset and length in bytes).
+// With `ecc`, fields covering check bytes are refused: every write recomputes
+// those bytes.
+static int w1_ds2432_field_parse(char *spec, struct w1_ds2432_field *field,
+                                 bool ecc) {
+  char *name, *offset, *length, *type;
+  unsigned int i;
+  u8 size = 0;
+
+  name = strsep(&spec, ",");
+  offset = strsep(&spec, ",");
+  length = strsep(&spec, ",");
+  type = spec;
+  if (!type || !name[0] || strlen(name) >= sizeof(field->name) ||
+      kstrtou8(offset, 0, &field->offset) ||
+      kstrtou8(length, 0, &field->length)) {
+    return -EINVAL;
+  }
+
+  for (i = 0; name[i]; i++) {
+    if (!isalnum(name[i]) && name[i] != '_') {
+      return -EINVAL;
+    }
+  }
+  strscpy(field->name, name, sizeof(field->name));
+
+  for (i = 0; i < ARRAY_SIZE(w1_ds2432_field_types); i++) {
+    if (!strcmp(type, w1_ds2432_field_types[i])) {
+      break;
+    }
+  }
+
+  switch (i) {
+  case W1_DS2432_FIELD_U8:
+    size = 1;
+    break;
+  case W1_DS2432_FIELD_U16:
+    size = 2;
+    break;
+  case W1_DS2432_FIELD_U32:
+    size = 4;
+    break;
+  case W1_DS2432_FIELD_STR:
+  case W1_DS2432_FIELD_RAW:
+    size = field->length;
+    break;
+  case W1_DS2432_FIELD_COUNTER:
+    size = field->length;
+    if (w1_ds2432_counter_check(field->offset,
+                                field->length / W1_DS2432_BLOCK_SIZE) < 0 ||
+        field->length % W1_DS2432_BLOCK_SIZE) {
+      return -EINVAL;
+    }
+    break;
+  default:
+    return -EINVAL;
+  }
+  field->type = i;
+
+  if (field->length == 0 || field->length != size ||
+      field->offset + field->length > W1_DS2432_DATA_MEMORY_SIZE ||
+      (ecc && w1_ds2432_ecc_overlaps(field->offset, field->length))) {
+    return -EINVAL;
+  }
+
+  return 0;
+}
+
+static ssize_t w1_ds2432_field_read(struct file *filp, struct kobject *kobj,
+                                    struct bin_attribute *bin_attr, char *buf,
+                                    loff_t off, size_t count) {
+  struct w1_ds2432_field_attr *fa =
+      container_of(bin_attr, struct w1_ds2432_field_attr, attr);
+  const struct w1_ds2432_field *field = &fa->field;
+  u8 value[W1_DS2432_DATA_MEMORY_SIZE];
+  char text[W1_DS2432_DATA_MEMORY_SIZE + 1];
+  size_t len;
+  ssize_t result;
+  u32 counter;
+
+  if (field->type == W1_DS2432_FIELD_COUNTER) {
+    result = w1_b3_counter_read(fa->sl, field->offset,
+                                field->length / W1_DS2432_BLOCK_SIZE, &counter);
+    if (result < 0) {
+      return result;
+    }
+    len = scnprintf(text, sizeof(text), "%u\n", counter);
+    goto out;
+  }
+
+  result = w1_b3_queue_io(fa->sl, false, field->offset, value, field->length);
+  if (result < 0) {
+    return result;
+  }
+
+  switch (field->type) {
+  case W1_DS2432_FIELD_U8:
+    len = scnprintf(text, sizeof(text), "%u\n", value[0]);
+    break;
+  case W1_DS2432_FIELD_U16:
+    len = scnprintf(text, sizeof(text), "%u\n", get_unaligned_le16(value));
+    break;
+  case W1_DS2432_FIELD_U32:
+    len = scnprintf(text, sizeof(text), "%u\n", get_unaligned_le32(value));
+    break;
+  case W1_DS2432_FIELD_STR:
+    len = strnlen(value, field->length);
+    memcpy(text, value, len);
+    text[len++] = '\n';
+    break;
+  default:
+    len = field->length;
+    memcpy(text, value, len);
+  }
+
+out:
+  if ((count = w1_b3_fix_count(off, count, len)) == 0) {
+    return 0;
+  }
+
+  memcpy(buf, &text[off], count);
+
+  return count;
+}
+
+static ssize_t w1_ds2432_field_write(struct file *filp, struct kobject *kobj,
+                                     struct bin_attribute *bin_attr, char *buf,
+                                     loff_t off, size_t count) {
+  struct w1_ds2432_field_attr *fa =
+      container_of(bin_attr, struct w1_ds2432_field_attr, attr);
+  const struct w1_ds2432_field *field = &fa->field;
+  struct w1_b3_data *b3_data = fa->sl->family_data;
+  u8 value[W1_DS2432_DATA_MEMORY_SIZE] = {0};
+  char text[12];
+  size_t len = field->length;
+  u32 number;
+  ssize_t result;
+
+  // The layout may have changed since the field was defined.
+  if (READ_ONCE(b3_data->ecc) &&
+      w1_ds2432_ecc_overlaps(field->offset, field->length)) {
+    return -EINVAL;
+  }
+
+  if (field->type == W1_DS2432_FIELD_RAW) {
+    // Raw fields can be written in part.
+    if ((count = w1_b3_fix_count(off, count, field->length)) == 0) {
+      return -EINVAL;
+    }
+    result = w1_b3_queue_io(fa->sl, true, field->offset + off, buf, count);
+    return result < 0 ? result : count;
+  }
+
+  if (off != 0) {
+    return -EINVAL;
+  }
+
+  if (field->type == W1_DS2432_FIELD_STR) {
+    len = count;
+    if (len && buf[len - 1] == '\n') {
+      len--;
+    }
+    if (len > field->length) {
+      return -EINVAL;
+    }
+    memcpy(value, buf, len);
+  } else {
+    if (count >= sizeof(text)) {
+      return -EINVAL;
+    }
+    memcpy(text, buf, count);
+    text[count] = '\0';
+    if (kstrtou32(strim(text), 0, &number) ||
+        (field->length < 4 && number >> (8 * field->length))) {
+      return -EINVAL;
+    }
+    put_unaligned_le32(number, value);
+  }
+
+  if (field->type == W1_DS2432_FIELD_COUNTER) {
+    // Writing a counter adds to it.
+    if (number == 0) {
+      return -EINVAL;
+    }
+    result = w1_b3_counter_add(fa->sl, field->offset,
+                               field->length / W1_DS2432_BLOCK_SIZE, number,
+                               NULL);
+    return result < 0 ? result : count;
+  }
+
+  result = w1_b3_queue_io(fa->sl, true, field->offset, value, field->length);
+
+  return result < 0 ? result : count;
+}
+
+// Drop the field attributes of a slave. The caller must hold fields_lock.
+static void w1_b3_fields_remove(struct w1_b3_data *b3_data) {
+  if (b3_data->fields_kobj) {
+    // Removing the directory waits for the field handlers still running.
+    kobject_put(b3_data->fields_kobj);
+    b3_data->fields_kobj = NULL;
+  }
+
+  kfree(b3_data->field_attrs);
+  b3_data->field_attrs = NULL;
+  b3_data->field_attr_count = 0;
+}
+
+/**
+ * (Re)create the field attributes from the schema in effect for the slave:
+ * its own one if set, the entries of its manufacturer ID otherwise. Finding
+ * the manufacturer ID costs a register page read the first time only; if
+ * that read fails, the slave is left without fields and marked pending so
+ * that w1_b3_fields_retry() tries again. On error, no field is left behind.
+ */
+static int w1_b3_fields_apply(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  struct w1_ds2432_field fields[W1_DS2432_FIELD_MAX];
+  struct w1_ds2432_field_attr *attrs;
+  unsigned int count = 0;
+  unsigned int i;
+  u8 manufacturer_id[2];
+  int error = 0;
+
+  mutex_lock(&b3_data->fields_lock);
+
+  WRITE_ONCE(b3_data->fields_pending, false);
+
+  if (b3_data->field_count) {
+    count = b3_data->field_count;
+    memcpy(fields, b3_data->fields, count * sizeof(fields[0]));
+  } else if (READ_ONCE(w1_ds2432_field_schema_len)) {
+    w1_b3_lock(sl);
+    error = w1_ds2432_register_get(sl, W1_DS2432_REG_MANUFACTURER_ID,
+                                   manufacturer_id, sizeof(manufacturer_id));
+    w1_b3_unlock(sl);
+    WRITE_ONCE(b3_data->fields_pending, error < 0);
+
+    mutex_lock(&w1_ds2432_field_schema_lock);
+    for (i = 0; !error && i < w1_ds2432_field_schema_len &&
+                count < W1_DS2432_FIELD_MAX;
+         i++) {
+      if (!memcmp(w1_ds2432_field_schema[i].manufacturer_id, manufacturer_id,
+                  sizeof(manufacturer_id))) {
+        fields[count++] = w1_ds2432_field_schema[i].field;
+      }
+    }
+    mutex_unlock(&w1_ds2432_field_schema_lock);
+  }
+
+  w1_b3_fields_remove(b3_data);
+
+  if (error < 0 || count == 0) {
+    goto out;
+  }
+
+  attrs = kcalloc(count, sizeof(*attrs), GFP_KERNEL);
+  b3_data->fields_kobj = kobject_create_and_add("fields", &sl->dev.kobj);
+  if (!attrs || !b3_data->fields_kobj) {
+    kfree(attrs);
+    w1_b3_fields_remove(b3_data);
+    error = -ENOMEM;
+    goto out;
+  }
+  b3_data->field_attrs = attrs;
+
+  for (i = 0; i < count; i++) {
+    struct w1_ds2432_field_attr *fa = &attrs[i];
+
+    fa->sl = sl;
+    fa->field = fields[i];
+    sysfs_bin_attr_init(&fa->attr);
+    fa->attr.attr.name = fa->field.name;
+    fa->attr.attr.mode = 0644;
+    fa->attr.size = fa->field.type == W1_DS2432_FIELD_RAW ? fa->field.length
+                                                          : 0;
+    fa->attr.read = w1_ds2432_field_read;
+    fa->attr.write = w1_ds2432_field_write;
+
+    error = sysfs_create_bin_file(b3_data->fields_kobj, &fa->attr);
+    if (error < 0) {
+      dev_warn(&sl->dev, "field %s: %d\n", fa->field.name, error);
+      w1_b3_fields_remove(b3_data);
+      break;
+    }
+    b3_data->field_attr_count++;
+  }
+
+out:
+  mutex_unlock(&b3_data->fields_lock);
+
+  return error;
+}
+
+/**
+ * Set up the fields again if the manufacturer ID could not be read last time.
+ * Called on access; must not be called from a field attribute handler.
+ */
+static void w1_b3_fields_retry(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+
+  if (READ_ONCE(b3_data->fields_pending)) {
+    w1_b3_fields_apply(sl);
+  }
+}
+
+// The schema in effect, one "<name>,<offset>,<length>,<type>" line per field.
+// Writing lines sets the slave's own schema, writing "clear" drops it.
+static ssize_t field_schema_read(struct file *filp, struct kobject *kobj,
+                                 struct bin_attribute *bin_attr, char *buf,
+                                 loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+  char *text;
+  size_t len = 0;
+  unsigned int i;
+
+  w1_b3_fields_retry(sl);
+
+  text = kzalloc(PAGE_SIZE, GFP_KERNEL);
+  if (!text) {
+    return -ENOMEM;
+  }
+
+  mutex_lock(&b3_data->fields_lock);
+  for (i = 0; i < b3_data->field_attr_count; i++) {
+    const struct w1_ds2432_field *field = &b3_data->field_attrs[i].field;
+
+    len += scnprintf(text + len, PAGE_SIZE - len, "%s,%u,%u,%s\n", field->name,
+                     field->offset, field->length,
+                     w1_ds2432_field_types[field->type]);
+  }
+  mutex_unlock(&b3_data->fields_lock);
+
+  if ((count = w1_b3_fix_count(off, count, len)) > 0) {
+    memcpy(buf, text + off, count);
+  }
+
+  kfree(text);
+
+  return count;
+}
+
+static ssize_t field_schema_write(struct file *filp, struct kobject *kobj,
+                                  struct bin_attribute *bin_attr, char *buf,
+                                  loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+  struct w1_ds2432_field fields[W1_DS2432_FIELD_MAX];
+  unsigned int field_count = 0;
+  char *text, *spec, *line;
+  unsigned int i;
+  int error = 0;
+
+  if (off != 0) {
+    return -EINVAL;
+  }
+
+  text = kstrndup(buf, count, GFP_KERNEL);
+  if (!text) {
+    return -ENOMEM;
+  }
+
+  spec = text;
+  if (strcmp(strim(spec), "clear")) {
+    while ((line = strsep(&spec, "\n")) != NULL) {
+      line = strim(line);
+      if (!line[0]) {
+        continue;
+      }
+      if (field_count == W1_DS2432_FIELD_MAX) {
+        error = -ENOSPC;
+        break;
+      }
+      error = w1_ds2432_field_parse(line, &fields[field_count],
+                                    READ_ONCE(b3_data->ecc));
+      if (error < 0) {
+        break;
+      }
+      for (i = 0; i < field_count; i++) {
+        if (!strcmp(fields[i].name, fields[field_count].name)) {
+          error = -EEXIST;
+        }
+      }
+      if (error < 0) {
+        break;
+      }
+      field_count++;
+    }
+  }
+
+  kfree(text);
+
+  if (error < 0) {
+    return error;
+  }
+
+  mutex_lock(&b3_data->fields_lock);
+  memcpy(b3_data->fields, fields, field_count * sizeof(fields[0]));
+  b3_data->field_count = field_count;
+  mutex_unlock(&b3_data->fields_lock);
+
+  error = w1_b3_fields_apply(sl);
+
+  return error < 0 ? error : count;
+}
+
+static BIN_ATTR_RW(field_schema, 0);
+
+//
+// EPROM mode log
+//
+// Once in EPROM mode (eprom_mode_page_1), the bits of page 1 can only go from
+// 1 to 0, which makes it a tamper-evident append-only log: one byte per event,
+// any value but FFh, which marks the free space. The position of the first
+// free byte is cached, so an append costs no scan and, as long as it stays
+// within one block, a single block copy.
+//
+
+/**
+ * Whether page 1 is in EPROM mode: 1 if it is, 0 if not, or a negative error.
+ * The register page comes from the regmap cache.
+ *
+ * The caller must hold the bus_mutex.
+ */
+static int w1_b3_eprom_mode(struct w1_slave *sl) {
+  u8 mode;
+  int error;
+
+  error = w1_ds2432_register_get(sl, W1_DS2432_REG_EPROM_PAGE_1, &mode, 1);
+  if (error < 0) {
+    return error;
+  }
+
+  return w1_ds2432_is_protect_code(mode);
+}
+
+// Find the first free byte of the log, from the cache. The caller must hold
+// the bus_mutex.
+static int w1_b3_eprom_tail(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  const u8 *log = &b3_data->image[W1_DS2432_PAGE_1_ADDR];
+  int error;
+
+  if (b3_data->eprom_tail_valid &&
+      b3_data->eprom_tail_gen == b3_data->image_gen &&
+      b3_data->page_state[1] == W1_DS2432_PAGE_TRUSTED) {
+    return b3_data->eprom_tail;
+  }
+
+  error = w1_b3_confirm_import(sl);
+  if (error < 0) {
+    return error;
+  }
+
+  error = w1_b3_fill_pages(sl, 1, 1);
+  if (error < 0) {
+    return error;
+  }
+
+  b3_data->eprom_tail = 0;
+  while (b3_data->eprom_tail < W1_DS2432_PAGE_SIZE &&
+         log[b3_data->eprom_tail] != 0xFF) {
+    b3_data->eprom_tail++;
+  }
+  b3_data->eprom_tail_gen = b3_data->image_gen;
+  b3_data->eprom_tail_valid = true;
+
+  return b3_data->eprom_tail;
+}
+
+static int w1_b3_eprom_append(struct w1_slave *sl, const u8 *events,
+                              size_t count) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  ssize_t result;
+  int tail;
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    if (events[i] == 0xFF) {
+      return -EINVAL;
+    }
+  }
+
+  mutex_lock(&b3_data->update_lock);
+
+  w1_b3_lock(sl);
+  result = w1_b3_eprom_mode(sl);
+  if (result == 0) {
+    // EPERM: the log is only append-only in EPROM mode.
+    result = -EPERM;
+  } else if (result > 0 && b3_data->ecc) {
+    // EOPNOTSUPP: a page code cannot be rewritten when bits only clear.
+    result = -EOPNOTSUPP;
+  }
+  tail = result < 0 ? result : w1_b3_eprom_tail(sl);
+  w1_b3_unlock(sl);
+
+  if (result < 0 || tail < 0) {
+    result = result < 0 ? result : tail;
+    goto out;
+  }
+
+  if (tail + count > W1_DS2432_PAGE_SIZE) {
+    result = -ENOSPC;
+    goto out;
+  }
+
+  result = w1_b3_queue_io(sl, true, W1_DS2432_PAGE_1_ADDR + tail,
+                          (u8 *)events, count);
+  if (result < 0) {
+    goto out;
+  }
+
+  w1_b3_lock(sl);
+  if (b3_data->page_state[1] == W1_DS2432_PAGE_TRUSTED) {
+    b3_data->eprom_tail = tail + count;
+    b3_data->eprom_tail_gen = b3_data->image_gen;
+  }
+  w1_b3_unlock(sl);
+
+out:
+  mutex_unlock(&b3_data->update_lock);
+
+  return result < 0 ? result : 0;
+}
+
+// Reads return the events logged so far; writes append events.
+static ssize_t eprom_log_read(struct file *filp, struct kobject *kobj,
+                              struct bin_attribute *bin_attr, char *buf,
+                              loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+  int tail;
+
+  w1_b3_lock(sl);
+
+  if (!READ_ONCE(cache)) {
+    w1_b3_invalidate_cache(sl);
+  }
+
+  tail = w1_b3_eprom_tail(sl);
+  if (tail >= 0) {
+    count = w1_b3_fix_count(off, count, tail);
+    memcpy(buf, &b3_data->image[W1_DS2432_PAGE_1_ADDR + off], count);
+  }
+
+  w1_b3_unlock(sl);
+
+  return tail < 0 ? tail : count;
+}
+
+static ssize_t eprom_log_write(struct file *filp, struct kobject *kobj,
+                               struct bin_attribute *bin_attr, char *buf,
+                               loff_t off, size_t count) {
+  int error;
+
+  error = w1_b3_eprom_append(kobj_to_w1_slave(kobj), buf, count);
+
+  return error < 0 ? error : count;
+}
+
+static BIN_ATTR_RW(eprom_log, W1_DS2432_PAGE_SIZE);
+
+//
+// Transaction scripts
+//
+// A script is a fixed sequence of operations, loaded once through the script
+// attribute and then run in the kernel, in one bus session, against the slave
+// or against every slave of its master whose ROM ID starts with a prefix.
+//
+// Program layout: struct w1_ds2432_script_header, `count` 4-byte operations,
+// then `data_len` bytes the writes take their data from. Each operation sets
+// the status (0 or a negative errno), which jumps can test. Jumps only go
+// forward and stay within their loop, and loops run over at most every page,
+// so every script ends. The checks happen when the script is loaded.
+//
+
+#define W1_DS2432_SCRIPT_MAGIC          "B3X1"
+#define W1_DS2432_SCRIPT_MAX_OPS        64
+#define W1_DS2432_SCRIPT_MAX_DEPTH      2
+// Output kept per slave and run.
+#define W1_DS2432_SCRIPT_OUTPUT_SIZE    512
+
+enum w1_ds2432_script_scope {
+  W1_DS2432_SCRIPT_SLAVE = 0,  // this slave
+  W1_DS2432_SCRIPT_MASTER,     // the matching slaves of this slave's master
+};
+
+enum w1_ds2432_script_opcode {
+  W1_DS2432_OP_END = 0,  // stop, with result 0
+  W1_DS2432_OP_READ,     // output `b` bytes of data memory at `a`
+  W1_DS2432_OP_WRITE,    // write `b` bytes at `a`, from data offset `c`
+  W1_DS2432_OP_AUTH,     // output page `a`, read and checked with its MAC
+  W1_DS2432_OP_REGS,     // output the register page
+  W1_DS2432_OP_LOOP,     // run up to the matching NEXT for pages `a` to `b`
+  W1_DS2432_OP_NEXT,
+  W1_DS2432_OP_JUMP,     // go to `c` always (a = 0), when status is -`b`
+                         // (a = 1) or when it is not (a = 2)
+  W1_DS2432_OP_FAIL,     // stop, with the status as result
+};
+
+// With READ, WRITE and AUTH: `a` is relative to the page of the inner loop.
+#define W1_DS2432_OP_PAGED              0x80
+
+struct w1_ds2432_script_header {
+  u8 magic[4];
+  u8 scope;       // enum w1_ds2432_script_scope
+  u8 match_len;   // ROM ID prefix length, master scope only
+  u8 count;       // operations
+  u8 data_len;
+  u8 match[8];    // ROM ID prefix, registration_number byte order
+} __packed;
+
+struct w1_ds2432_script_op {
+  u8 op;
+  u8 a;
+  u8 b;
+  u8 c;
+} __packed;
+
+// Output of one slave, followed by `length` bytes.
+struct w1_ds2432_script_result {
+  u8 registration_number[8];
+  __le32 error;   // errno the script ended with, 0 for none
+  __le16 length;
+  u8 reserved[2];
+} __packed;
+
+// Check a program before it is accepted; see the section comment.
+static int w1_ds2432_script_check(const u8 *program, size_t size) {
+  const struct w1_ds2432_script_header *header = (const void *)program;
+  const struct w1_ds2432_script_op *ops = (const void *)(header + 1);
+  s8 loop_of[W1_DS2432_SCRIPT_MAX_OPS];
+  s8 loops[W1_DS2432_SCRIPT_MAX_DEPTH];
+  unsigned int depth = 0;
+  unsigned int limit;
+  int i;
+
+  if (size < sizeof(*header) ||
+      memcmp(header->magic, W1_DS2432_SCRIPT_MAGIC, sizeof(header->magic))) {
+    return -EINVAL;
+  }
+
+  if (header->count == 0 || header->count > W1_DS2432_SCRIPT_MAX_OPS ||
+      header->data_len > W1_DS2432_DATA_MEMORY_SIZE ||
+      size != sizeof(*header) + header->count * sizeof(*ops) +
+                  header->data_len) {
+    return -EINVAL;
+  }
+
+  if (header->scope > W1_DS2432_SCRIPT_MASTER ||
+      header->match_len > sizeof(header->match) ||
+      (header->scope == W1_DS2432_SCRIPT_SLAVE && header->match_len)) {
+    return -EINVAL;
+  }
+
+  for (i = 0; i < header->count; i++) {
+    const struct w1_ds2432_script_op *op = &ops[i];
+    u8 code = op->op & ~W1_DS2432_OP_PAGED;
+    bool paged = op->op & W1_DS2432_OP_PAGED;
+
+    loop_of[i] = depth ? loops[depth - 1] : -1;
+
+    if (paged &&
+        (!depth || code < W1_DS2432_OP_READ || code > W1_DS2432_OP_AUTH)) {
+      return -EINVAL;
+    }
+    limit = paged ? W1_DS2432_PAGE_SIZE : W1_DS2432_DATA_MEMORY_SIZE;
+
+    switch (code) {
+    case W1_DS2432_OP_END:
+    case W1_DS2432_OP_REGS:
+    case W1_DS2432_OP_FAIL:
+      break;
+
+    case W1_DS2432_OP_WRITE:
+      if (op->c + op->b > header->data_len) {
+        return -EINVAL;
+      }
+      fallthrough;
+    case W1_DS2432_OP_READ:
+      if (op->b == 0 || op->a + op->b > limit) {
+        return -EINVAL;
+      }
+      break;
+
+    case W1_DS2432_OP_AUTH:
+      if (paged ? op->a != 0 : op->a >= W1_DS2432_PAGE_COUNT) {
+        return -EINVAL;
+      }
+      break;
+
+    case W1_DS2432_OP_LOOP:
+      if (depth == W1_DS2432_SCRIPT_MAX_DEPTH || op->a > op->b ||
+          op->b >= W1_DS2432_PAGE_COUNT) {
+        return -EINVAL;
+      }
+      loops[depth++] = i;
+      break;
+
+    case W1_DS2432_OP_NEXT:
+      if (!depth) {
+        return -EINVAL;
+      }
+      depth--;
+      break;
+
+    case W1_DS2432_OP_JUMP:
+      if (op->a > 2 || op->c <= i || op->c >= header->count) {
+        return -EINVAL;
+      }
+      break;
+
+    default:
+      return -EINVAL;
+    }
+  }
+
+  if (depth) {
+    return -EINVAL;
+  }
+
+  // Jumps land in the loop they leave from.
+  for (i = 0; i < header->count; i++) {
+    if (ops[i].op == W1_DS2432_OP_JUMP && loop_of[ops[i].c] != loop_of[i]) {
+      return -EINVAL;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Run a checked script against one slave, filling `result` and the output that
+ * follows it, at most W1_DS2432_SCRIPT_OUTPUT_SIZE bytes.
+ *
+ * Returns the size of the result with its output. The caller must hold the
+ * bus_mutex.
+ */
+static size_t w1_b3_script_run(struct w1_slave *sl, const u8 *program,
+                               struct w1_ds2432_script_result *result) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  const struct w1_ds2432_script_header *header = (const void *)program;
+  const struct w1_ds2432_script_op *ops = (const void *)(header + 1);
+  const u8 *data = (const u8 *)&ops[header->count];
+  u8 *output = (u8 *)(result + 1);
+  struct {
+    unsigned int pc;
+    u8 page;
+  } loops[W1_DS2432_SCRIPT_MAX_DEPTH];
+  unsigned int depth = 0;
+  unsigned int length = 0;
+  unsigned int pc = 0;
+  int status = 0;
+  int error = 0;
+
+  while (pc < header->count) {
+    const struct w1_ds2432_script_op *op = &ops[pc];
+    unsigned int base = 0;
+    u8 page = op->a;
+    size_t need = 0;
+
+    if (op->op & W1_DS2432_OP_PAGED) {
+      page = loops[depth - 1].page;
+      base = page * W1_DS2432_PAGE_SIZE;
+    }
+
+    switch (op->op & ~W1_DS2432_OP_PAGED) {
+    case W1_DS2432_OP_READ:
+      need = op->b;
+      break;
+    case W1_DS2432_OP_AUTH:
+      need = W1_DS2432_PAGE_SIZE;
+      break;
+    case W1_DS2432_OP_REGS:
+      need = W1_DS2432_REGISTER_PAGE_SIZE;
+      break;
+    }
+
+    if (length + need > W1_DS2432_SCRIPT_OUTPUT_SIZE) {
+      error = -ENOSPC;
+      break;
+    }
+
+    switch (op->op & ~W1_DS2432_OP_PAGED) {
+    case W1_DS2432_OP_END:
+      goto out;
+
+    case W1_DS2432_OP_FAIL:
+      error = status;
+      goto out;
+
+    case W1_DS2432_OP_READ:
+      status = w1_b3_io_locked(sl, false, base + op->a, &output[length], op->b);
+      if (status == 0) {
+        length += op->b;
+      }
+      break;
+
+    case W1_DS2432_OP_WRITE:
+      status = w1_b3_io_locked(sl, true, base + op->a, (u8 *)&data[op->c],
+                               op->b);
+      break;
+
+    case W1_DS2432_OP_AUTH:
+      status = w1_ds2432_authenticate_page(sl, w1_b3_secret(sl), page,
+                                           &output[length]);
+      if (status == 0) {
+        length += W1_DS2432_PAGE_SIZE;
+      }
+      break;
+
+    case W1_DS2432_OP_REGS:
+      status = w1_ds2432_register_get(sl, 0, &output[length],
+                                      W1_DS2432_REGISTER_PAGE_SIZE);
+      if (status == 0) {
+        length += W1_DS2432_REGISTER_PAGE_SIZE;
+      }
+      break;
+
+    case W1_DS2432_OP_LOOP:
+      loops[depth].pc = pc;
+      loops[depth].page = op->a;
+      depth++;
+      break;
+
+    case W1_DS2432_OP_NEXT:
+      if (loops[depth - 1].page < ops[loops[depth - 1].pc].b) {
+        loops[depth - 1].page++;
+        pc = loops[depth - 1].pc + 1;
+        continue;
+      }
+      depth--;
+      break;
+
+    case W1_DS2432_OP_JUMP:
+      if (op->a == 0 || (op->a == 1) == (status == -op->b)) {
+        pc = op->c;
+        continue;
+      }
+      break;
+    }
+
+    // A device that is gone answers nothing else.
+    if (status == -ENODEV || b3_data->absent) {
+      error = -ENODEV;
+      break;
+    }
+
+    pc++;
+  }
+
+out:
+  memcpy(result->registration_number, b3_data->registration_number,
+         sizeof(result->registration_number));
+  result->error = cpu_to_le32(-error);
+  result->length = cpu_to_le16(length);
+  memset(result->reserved, 0, sizeof(result->reserved));
+
+  return sizeof(*result) + length;
+}
+
+// Run the loaded script against its slaves, replacing the output. Each slave
+// runs in one bus session, under its update_lock so that record, counter and
+// log updates cannot land between two operations. The caller must hold
+// script_lock.
+static int w1_b3_script_exec(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  const struct w1_ds2432_script_header *header = (const void *)b3_data->script;
+  const size_t slot = sizeof(struct w1_ds2432_script_result) +
+                      W1_DS2432_SCRIPT_OUTPUT_SIZE;
+  struct w1_ds2432_master *bus;
+  struct w1_b3_data *target;
+  bool found = false;
+  size_t length = 0;
+  u8 *output;
+
+  if (header->scope == W1_DS2432_SCRIPT_SLAVE) {
+    output = kmalloc(slot, GFP_KERNEL);
+    if (!output) {
+      return -ENOMEM;
+    }
+
+    mutex_lock(&b3_data->update_lock);
+    w1_b3_lock(sl);
+    length = w1_b3_script_run(sl, b3_data->script, (void *)output);
+    w1_b3_unlock(sl);
+    mutex_unlock(&b3_data->update_lock);
+    goto out;
+  }
+
+  // The slave list of the master stays as it is for the whole run, and with
+  // it the bus bookkeeping: this slave cannot go away while its attribute is
+  // being written.
+  mutex_lock(&w1_ds2432_masters_lock);
+  list_for_each_entry(bus, &w1_ds2432_masters, entry) {
+    if (bus->master == sl->master) {
+      found = true;
+      break;
+    }
+  }
+  if (!found) {
+    mutex_unlock(&w1_ds2432_masters_lock);
+    return -ENODEV;
+  }
+  mutex_lock(&bus->lock);
+  mutex_unlock(&w1_ds2432_masters_lock);
+
+  output = kmalloc_array(bus->slave_count, slot, GFP_KERNEL);
+  if (!output) {
+    mutex_unlock(&bus->lock);
+    return -ENOMEM;
+  }
+
+  list_for_each_entry(target, &bus->slaves, bus_entry) {
+    if (memcmp(target->registration_number, header->match,
+               header->match_len)) {
+      continue;
+    }
+
+    mutex_lock(&target->update_lock);
+    w1_b3_lock(target->sl);
+    length += w1_b3_script_run(target->sl, b3_data->script,
+                               (void *)&output[length]);
+    w1_b3_unlock(target->sl);
+    mutex_unlock(&target->update_lock);
+  }
+
+  mutex_unlock(&bus->lock);
+
+out:
+  kfree(b3_data->script_output);
+  b3_data->script_output = output;
+  b3_data->script_output_len = length;
+
+  return 0;
+}
+
+static ssize_t script_read(struct file *filp, struct kobject *kobj,
+                           struct bin_attribute *bin_attr, char *buf,
+                           loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+
+  mutex_lock(&b3_data->script_lock);
+  if ((count = w1_b3_fix_count(off, count, b3_data->script_output_len)) > 0) {
+    memcpy(buf, &b3_data->script_output[off], count);
+  }
+  mutex_unlock(&b3_data->script_lock);
+
+  return count;
+}
+
+// Writing a program loads and runs it; writing only the magic runs the loaded
+// program again.
+static ssize_t script_write(struct file *filp, struct kobject *kobj,
+                            struct bin_attribute *bin_attr, char *buf,
+                            loff_t off, size_t count) {
+  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  struct w1_b3_data *b3_data = sl->family_data;
+  u8 *program;
+  int error;
+
+  if (off != 0) {
+    return -EINVAL;
+  }
+
+  mutex_lock(&b3_data->script_lock);
+
+  if (count == strlen(W1_DS2432_SCRIPT_MAGIC) &&
+      !memcmp(buf, W1_DS2432_SCRIPT_MAGIC, count)) {
+    // ENOENT: nothing loaded.
+    error = b3_data->script ? 0 : -ENOENT;
+  } else {
+    error = w1_ds2432_script_check(buf, count);
+    if (error == 0) {
+      program = kmemdup(buf, count, GFP_KERNEL);
+      if (!program) {
+        error = -ENOMEM;
+      } else {
+        kfree(b3_data->script);
+        b3_data->script = program;
+        b3_data->script_len = count;
+      }
+    }
+  }
+
+  if (error == 0) {
+    error = w1_b3_script_exec(sl);
+  }
+
+  mutex_unlock(&b3_data->script_lock);
+
+  return error < 0 ? error : count;
+}
+
+static BIN_ATTR_RW(script, 0);
+
+static struct bin_attribute *w1_ds2432_bin_attributes[] = {
+    &bin_attr_eeprom,
+    &bin_attr_records,
+    &bin_attr_record_index,
+    &bin_attr_read_mode,
+    &bin_attr_ecc,
+    &bin_attr_ecc_stats,
+    &bin_attr_link_policy,
+    &bin_attr_cache_image,
+    &bin_attr_secret,
+    &bin_attr_secret_key,
+    &bin_attr_secret_sync,
+    &bin_attr_authentic,
+    &bin_attr_authenticated_image,
+    &bin_attr_register_page,
+    // Register page break-down
+    &bin_attr_write_protect_secret,
+    &bin_attr_write_protect_pages_03,
+    &bin_attr_user_byte,
+    &bin_attr_factory_byte,
+    &bin_attr_eprom_mode_page_1,
+    &bin_attr_write_protect_page_0,
+    &bin_attr_manufacturer_id,
+    &bin_attr_registration_number,
+    &bin_attr_rotation,
+    &bin_attr_transaction_log,
+    &bin_attr_field_schema,
+    &bin_attr_eprom_log,
+    &bin_attr_script,
+    NULL,
+};
+
+static const struct attribute_group w1_ds2432_group = {
+    .bin_attrs = w1_ds2432_bin_attributes,
+};
+
+static const struct attribute_group *w1_b3_groups[] = {
+    &w1_ds2432_group,
+    NULL,
+};
+
+//
+// Per-master state and change-detection scanner
+//
+// Every w1 master with at least one DS2432 gets a w1_ds2432_master. Its
+// worker sweeps the cached slaves every scan_interval_ms, spending at most
+// scan_budget_ms per sweep, and checks one cached page per slave with the
+// cheapest available command. Slaves whose content changed get their cache
+// updated and a change notification (sysfs poll on eeprom and a uevent).
+//
+
+static unsigned int scan_interval_ms;
+static unsigned int scan_budget_ms = 50;
+static int scan_version_addr = -1;
+
+static int w1_ds2432_scan_interval_set(const char *val,
+                                       const struct kernel_param *kp) {
+  struct w1_ds2432_master *bus;
+  int error;
+
+  error = param_set_uint(val, kp);
+  if (error < 0) {
+    return error;
+  }
+
+  // Start (or stop, on their next run) the workers right away.
+  mutex_lock(&w1_ds2432_masters_lock);
+  list_for_each_entry(bus, &w1_ds2432_masters, entry) {
+    mod_delayed_work(w1_ds2432_wq, &bus->scan_work, 0);
+  }
+  mutex_unlock(&w1_ds2432_masters_lock);
+
+  return 0;
+}
+
+static const struct kernel_param_ops w1_ds2432_scan_interval_ops = {
+    .set = w1_ds2432_scan_interval_set,
+    .get = param_get_uint,
+};
+
+module_param_cb(scan_interval_ms, &w1_ds2432_scan_interval_ops,
+                &scan_interval_ms, 0644);
+MODULE_PARM_DESC(scan_interval_ms, "check cached slaves for changes every "
+                                   "that many ms (0: never)");
+module_param(scan_budget_ms, uint, 0644);
+MODULE_PARM_DESC(scan_budget_ms, "bus time a master may spend per scan");
+module_param(scan_version_addr, int, 0644);
+MODULE_PARM_DESC(scan_version_addr, "address of an 8-byte version block "
+                                    "rewritten on every change; when set, "
+                                    "scans read only that block");
+
+/**
+ * Check one cached page of a slave against the device.
+ *
+ * When a version block is configured, only it is read, and any difference
+ * drops the whole cache. Otherwise the next cached page is read in full:
+ * authenticated when the slave has a secret (so a swapped or cloned device is
+ * noticed too), CRC-checked otherwise.
+ *
+ * Returns true when the content changed.
+ */
+static bool w1_b3_scan_slave(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  u8 page_data[W1_DS2432_PAGE_SIZE];
+  int version_addr = READ_ONCE(scan_version_addr);
+  bool changed = false;
+  int page = -1;
+  int error;
+  int i;
+
+  w1_b3_lock(sl);
+
+  if (version_addr >= 0 && version_addr <= W1_DS2432_DATA_MEMORY_SIZE - 8 &&
+      b3_data->page_state[version_addr / W1_DS2432_PAGE_SIZE] ==
+          W1_DS2432_PAGE_TRUSTED) {
+    // CRC-checked, so that a bit error is not taken for a change.
+    error = w1_ds2432_read_memory_checked(sl, version_addr, page_data, 8,
+                                          false);
+    if (!error && memcmp(page_data, &b3_data->image[version_addr], 8)) {
+      w1_b3_invalidate_cache(sl);
+      changed = true;
+    }
+    goto out;
+  }
+
+  for (i = 0; i < W1_DS2432_PAGE_COUNT; i++) {
+    int candidate = (b3_data->scan_page + i) % W1_DS2432_PAGE_COUNT;
+
+    if (b3_data->page_state[candidate] == W1_DS2432_PAGE_TRUSTED) {
+      page = candidate;
+      break;
+    }
+  }
+
+  if (page < 0) {
+    goto out;
+  }
+
+  b3_data->scan_page = (page + 1) % W1_DS2432_PAGE_COUNT;
+
+  if (b3_data->secret_source != W1_DS2432_SECRET_DEFAULT) {
+    error = w1_ds2432_authenticate_page(sl, w1_b3_secret(sl), page, page_data);
+  } else {
+    error = w1_ds2432_read_authenticated_page(sl, page, NULL, page_data, NULL);
+  }
+
+  // EACCES only says the secret is wrong, which the next sweep would say
+  // again; it tells nothing about the content.
+  if (!error && b3_data->ecc && w1_ds2432_ecc_correct(page_data) < 0) {
+    // Most likely a transfer error, but let the next read tell.
+    b3_data->page_state[page] = W1_DS2432_PAGE_EMPTY;
+    b3_data->image_gen++;
+    changed = true;
+  } else if (!error && memcmp(page_data,
+                              &b3_data->image[page * W1_DS2432_PAGE_SIZE],
+                              W1_DS2432_PAGE_SIZE)) {
+    memcpy(&b3_data->image[page * W1_DS2432_PAGE_SIZE], page_data,
+           W1_DS2432_PAGE_SIZE);
+    b3_data->image_gen++;
+    changed = true;
+  }
+
+out:
+  if (changed) {
+    w1_b3_invalidate_verdict(sl);
+  }
+
+  w1_b3_unlock(sl);
+
+  return changed;
+}
+
+static void w1_ds2432_scan_work(struct work_struct *work) {
+  struct w1_ds2432_master *bus =
+      container_of(to_delayed_work(work), struct w1_ds2432_master, scan_work);
+  unsigned int interval = READ_ONCE(scan_interval_ms);
+  s64 budget_us = (s64)READ_ONCE(scan_budget_ms) * 1000;
+  ktime_t start = ktime_get();
+  unsigned int scanned;
+
+  if (!interval) {
+    return;
+  }
+
+  mutex_lock(&bus->lock);
+  for (scanned = 0; scanned < bus->slave_count; scanned++) {
+    struct w1_b3_data *b3_data =
+        list_first_entry(&bus->slaves, struct w1_b3_data, bus_entry);
+    struct w1_slave *sl = b3_data->sl;
+
+    // Rotate, so that the next sweep resumes where the budget ran out.
+    list_move_tail(&b3_data->bus_entry, &bus->slaves);
+
+    if (w1_b3_scan_slave(sl)) {
+      dev_info(&sl->dev, "eeprom content changed\n");
+      sysfs_notify(&sl->dev.kobj, NULL, "eeprom");
+      kobject_uevent(&sl->dev.kobj, KOBJ_CHANGE);
+    }
+
+    if (ktime_us_delta(ktime_get(), start) >= budget_us) {
+      break;
+    }
+  }
+  mutex_unlock(&bus->lock);
+
+  queue_delayed_work(w1_ds2432_wq, &bus->scan_work, msecs_to_jiffies(interval));
+}
+
+// Attach a slave to its master's bookkeeping, creating it on first use.
+static int w1_ds2432_bus_attach(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  struct w1_ds2432_master *bus;
+  bool found = false;
+
+  mutex_lock(&w1_ds2432_masters_lock);
+
+  list_for_each_entry(bus, &w1_ds2432_masters, entry) {
+    if (bus->master == sl->master) {
+      found = true;
+      break;
+    }
+  }
+
+  if (!found) {
+    bus = kzalloc(sizeof(*bus), GFP_KERNEL);
+    if (!bus) {
+      mutex_unlock(&w1_ds2432_masters_lock);
+      return -ENOMEM;
+    }
+
+    bus->master = sl->master;
+    mutex_init(&bus->lock);
+    INIT_LIST_HEAD(&bus->slaves);
+    INIT_DELAYED_WORK(&bus->scan_work, w1_ds2432_scan_work);
+    list_add_tail(&bus->entry, &w1_ds2432_masters);
+
+    if (READ_ONCE(scan_interval_ms)) {
+      queue_delayed_work(w1_ds2432_wq, &bus->scan_work,
+                         msecs_to_jiffies(scan_interval_ms));
+    }
+  }
+
+  mutex_lock(&bus->lock);
+  list_add_tail(&b3_data->bus_entry, &bus->slaves);
+  bus->slave_count++;
+  mutex_unlock(&bus->lock);
+
+  mutex_unlock(&w1_ds2432_masters_lock);
+
+  mutex_lock(&sl->master->bus_mutex);
+  b3_data->bus = bus;
+  mutex_unlock(&sl->master->bus_mutex);
+
+  return 0;
+}
+
+// Detach a slave from its master's bookkeeping, freeing it with the last one.
+static void w1_ds2432_bus_detach(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  struct w1_ds2432_master *bus = b3_data->bus;
+  bool last;
+
+  // Commands still running on this slave stop sampling the master's link.
+  mutex_lock(&sl->master->bus_mutex);
+  b3_data->bus = NULL;
+  mutex_unlock(&sl->master->bus_mutex);
+
+  mutex_lock(&w1_ds2432_masters_lock);
+
+  mutex_lock(&bus->lock);
+  list_del(&b3_data->bus_entry);
+  last = --bus->slave_count == 0;
+  mutex_unlock(&bus->lock);
+
+  if (last) {
+    list_del(&bus->entry);
+  }
+
+  mutex_unlock(&w1_ds2432_masters_lock);
+
+  if (last) {
+    cancel_delayed_work_sync(&bus->scan_work);
+    mutex_destroy(&bus->lock);
+    kfree(bus);
+  }
+}
+
+// Accepts "mfg:<hex id>=<name>,<offset>,<length>,<type>" or "clear". The
+// manufacturer ID is in register page order (008Eh first).
+static int w1_ds2432_field_schema_set(const char *val,
+                                      const struct kernel_param *kp) {
+  struct w1_ds2432_field_schema_entry entry = {0};
+  struct w1_ds2432_master *bus;
+  struct w1_b3_data *b3_data;
+  char *line, *spec, *id;
+  unsigned int i;
+  int error = 0;
+
+  line = kstrdup(val, GFP_KERNEL);
+  if (!line) {
+    return -ENOMEM;
+  }
+
+  spec = strim(line);
+
+  if (!strcmp(spec, "clear")) {
+    mutex_lock(&w1_ds2432_field_schema_lock);
+    w1_ds2432_field_schema_len = 0;
+    mutex_unlock(&w1_ds2432_field_schema_lock);
+    goto apply;
+  }
+
+  if (strncmp(spec, "mfg:", 4)) {
+    error = -EINVAL;
+    goto out;
+  }
+  spec += 4;
+
+  id = strsep(&spec, "=");
+  if (!spec || strlen(id) != 4 || hex2bin(entry.manufacturer_id, id, 2)) {
+    error = -EINVAL;
+    goto out;
+  }
+
+  error = w1_ds2432_field_parse(spec, &entry.field, READ_ONCE(ecc));
+  if (error < 0) {
+    goto out;
+  }
+
+  mutex_lock(&w1_ds2432_field_schema_lock);
+  for (i = 0; i < w1_ds2432_field_schema_len; i++) {
+    if (!memcmp(w1_ds2432_field_schema[i].manufacturer_id,
+                entry.manufacturer_id, sizeof(entry.manufacturer_id)) &&
+        !strcmp(w1_ds2432_field_schema[i].field.name, entry.field.name)) {
+      error = -EEXIST;
+    }
+  }
+  if (error < 0) {
+    // A field of that name already exists for the manufacturer ID.
+  } else if (w1_ds2432_field_schema_len == W1_DS2432_FIELD_SCHEMA_SIZE) {
+    error = -ENOSPC;
+  } else {
+    w1_ds2432_field_schema[w1_ds2432_field_schema_len++] = entry;
+  }
+  mutex_unlock(&w1_ds2432_field_schema_lock);
+
+  if (error < 0) {
+    goto out;
+  }
+
+apply:
+  // Bring the slaves already attached up to date.
+  mutex_lock(&w1_ds2432_masters_lock);
+  list_for_each_entry(bus, &w1_ds2432_masters, entry) {
+    mutex_lock(&bus->lock);
+    list_for_each_entry(b3_data, &bus->slaves, bus_entry) {
+      w1_b3_fields_apply(b3_data->sl);
+    }
+    mutex_unlock(&bus->lock);
+  }
+  mutex_unlock(&w1_ds2432_masters_lock);
+
+out:
+  kfree(line);
+
+  return error;
+}
+
+static const struct kernel_param_ops w1_ds2432_field_schema_ops = {
+    .set = w1_ds2432_field_schema_set,
+};
+
+module_param_cb(field_schema, &w1_ds2432_field_schema_ops, NULL, 0200);
+MODULE_PARM_DESC(field_schema, "add a field for a manufacturer ID "
+                               "(mfg:<hex>=<name>,<offset>,<length>,<type>), "
+                               "or clear the schema");
+
+/*
+ * In-kernel interface, see w1_ds2432.h.
+ *
+ * A handle lives as long as someone holds a reference on it. Operations run
+ * with its lock held for reading; remove_slave() takes it for writing to
+ * detach the handle, after which operations fail with -ENODEV.
+ */
+
+struct w1_ds2432 {
+  struct kref ref;
+  struct rw_semaphore lock;
+  struct w1_slave *sl;
+};
+
+enum w1_ds2432_async_op {
+  W1_DS2432_ASYNC_READ,
+  W1_DS2432_ASYNC_WRITE,
+  W1_DS2432_ASYNC_READ_AUTHENTICATED,
+};
+
+static void w1_ds2432_release(struct kref *ref) {
+  kfree(container_of(ref, struct w1_ds2432, ref));
+}
+
+struct w1_ds2432 *w1_ds2432_get(const u8 *registration_number) {
+  struct w1_ds2432_master *bus;
+  struct w1_b3_data *b3_data;
+  struct w1_ds2432 *ds = NULL;
+
+  mutex_lock(&w1_ds2432_masters_lock);
+  list_for_each_entry(bus, &w1_ds2432_masters, entry) {
+    mutex_lock(&bus->lock);
+    list_for_each_entry(b3_data, &bus->slaves, bus_entry) {
+      if (!memcmp(b3_data->registration_number, registration_number, 8)) {
+        ds = b3_data->handle;
+        kref_get(&ds->ref);
+        break;
+      }
+    }
+    mutex_unlock(&bus->lock);
+
+    if (ds) {
+      break;
+    }
+  }
+  mutex_unlock(&w1_ds2432_masters_lock);
+
+  return ds;
+}
+EXPORT_SYMBOL_GPL(w1_ds2432_get);
+
+void w1_ds2432_put(struct w1_ds2432 *ds) {
+  if (ds) {
+    kref_put(&ds->ref, w1_ds2432_release);
+  }
+}
+EXPORT_SYMBOL_GPL(w1_ds2432_put);
 
-  mutex_lock(&sl->master->bus_mutex);
+static int w1_ds2432_io(struct w1_ds2432 *ds, bool write, unsigned int off,
+                        void *buf, size_t count) {
+  ssize_t result = -ENODEV;
 
-  if (w1_ds2432_read_memory(sl, W1_DS2432_REGISTER_PAGE_ADDR + off, buf,
-                            W1_DS2432_REGISTER_PAGE_SIZE)) {
-    dev_err(&sl->dev, "unable to read register page\n");
-    count = -EIO;
-    goto out_up;
+  if (off > W1_DS2432_DATA_MEMORY_SIZE ||
+      count > W1_DS2432_DATA_MEMORY_SIZE - off) {
+    return -EINVAL;
   }
 
-  // Reset the bus to wake up the EEPROM (this may not be needed)
-  w1_reset_bus(sl->master);
+  down_read(&ds->lock);
+  if (ds->sl) {
+    result = w1_b3_queue_io(ds->sl, write, off, buf, count);
+  }
+  up_read(&ds->lock);
 
-out_up:
-  mutex_unlock(&sl->master->bus_mutex);
+  return result < 0 ? result : 0;
+}
 
-  return count;
+int w1_ds2432_read(struct w1_ds2432 *ds, unsigned int off, void *buf,
+                   size_t count) {
+  return w1_ds2432_io(ds, false, off, buf, count);
 }
+EXPORT_SYMBOL_GPL(w1_ds2432_read);
 
-static BIN_ATTR_RO(register_page, W1_DS2432_REGISTER_PAGE_SIZE);
+int w1_ds2432_write(struct w1_ds2432 *ds, unsigned int off, const void *buf,
+                    size_t count) {
+  // The queue only reads from the buffer of a write.
+  return w1_ds2432_io(ds, true, off, (void *)buf, count);
+}
+EXPORT_SYMBOL_GPL(w1_ds2432_write);
 
-//
-// Register page - write protect secret
-// 0088h Write-protect secret - Protection activated by code AAh or 55h
-//
+int w1_ds2432_read_authenticated(struct w1_ds2432 *ds, unsigned int page,
+                                 u8 *data) {
+  struct w1_slave *sl;
+  struct w1_b3_data *b3_data;
+  int error = -ENODEV;
 
-static ssize_t write_protect_secret_read(struct file *filp,
-                                         struct kobject *kobj,
-                                         struct bin_attribute *bin_attr,
-                                         char *buf, loff_t off, size_t count) {
-  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  if (page >= W1_DS2432_PAGE_COUNT) {
+    return -EINVAL;
+  }
 
-  mutex_lock(&sl->master->bus_mutex);
+  down_read(&ds->lock);
+  sl = ds->sl;
+  if (!sl) {
+    goto out;
+  }
 
-  if (w1_reset_select_slave(sl)) {
-    count = -EIO;
-    goto out_up;
+  b3_data = sl->family_data;
+
+  w1_b3_lock(sl);
+  error = w1_ds2432_authenticate_page(sl, w1_b3_secret(sl), page, data);
+  if (error == 0) {
+    // Proven genuine content, as good as any read for the cache.
+    memcpy(&b3_data->image[page * W1_DS2432_PAGE_SIZE], data,
+           W1_DS2432_PAGE_SIZE);
+    b3_data->page_state[page] = W1_DS2432_PAGE_TRUSTED;
+    b3_data->image_gen++;
   }
+  w1_b3_unlock(sl);
 
-  w1_ds2432_read_memory(sl, W1_DS2432_REGISTER_PAGE_ADDR + 0 + off, buf, count);
-out_up:
-  mutex_unlock(&sl->master->bus_mutex);
+out:
+  up_read(&ds->lock);
 
-  return count;
+  return error;
 }
+EXPORT_SYMBOL_GPL(w1_ds2432_read_authenticated);
 
-static ssize_t write_protect_secret_write(struct file *filp,
-                                          struct kobject *kobj,
-                                          struct bin_attribute *bin_attr,
-                                          char *buf, loff_t off, size_t count) {
-  return 0;
-}
+int w1_ds2432_authenticate_device(struct w1_ds2432 *ds, u8 *image) {
+  struct w1_ds2432_audit_record *record;
+  int error = -ENODEV;
 
-static BIN_ATTR_RW(write_protect_secret, 1);
+  record = kmalloc(sizeof(*record), GFP_KERNEL);
+  if (!record) {
+    return -ENOMEM;
+  }
 
-//
-// Register page - write protect page 0-3
-// 0089h Write-protect pages 0 to 3 - Protection activated by code AAh or 55h
-//
+  down_read(&ds->lock);
+  if (ds->sl) {
+    error = w1_b3_authenticate_device(ds->sl, record);
+  }
+  up_read(&ds->lock);
 
-static ssize_t write_protect_pages_03_read(struct file *filp,
-                                           struct kobject *kobj,
-                                           struct bin_attribute *bin_attr,
-                                           char *buf, loff_t off,
-                                           size_t count) {
-  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  if (error == 0 || error == -EACCES) {
+    memcpy(image, record->image, sizeof(record->image));
+  }
 
-  u8 write_protected[1];
+  kfree(record);
 
-  mutex_lock(&sl->master->bus_mutex);
+  return error;
+}
+EXPORT_SYMBOL_GPL(w1_ds2432_authenticate_device);
 
-  if (w1_ds2432_read_memory(sl, W1_DS2432_REGISTER_PAGE_ADDR + 1 + off,
-                            write_protected, sizeof(write_protected))) {
-    dev_err(&sl->dev, "unable to read memory\n");
-    count = -EIO;
-    goto out_up;
+int w1_ds2432_record_read(struct w1_ds2432 *ds, u8 id, void *buf,
+                          size_t size) {
+  int error = -ENODEV;
+
+  down_read(&ds->lock);
+  if (ds->sl) {
+    error = w1_b3_record_read(ds->sl, id, buf, size);
   }
+  up_read(&ds->lock);
 
-  // This field is only 1byte
-  count = 1;
+  return error;
+}
+EXPORT_SYMBOL_GPL(w1_ds2432_record_read);
 
-  // '0': disabled
-  buf[0] = '0';
-  if (write_protected[0] == 0x55 || write_protected[0] == 0xAA) {
-    // '1': enabled
-    buf[0] = '1';
-  }
+int w1_ds2432_record_write(struct w1_ds2432 *ds, u8 id, const void *value,
+                           size_t length) {
+  int error = -ENODEV;
 
-  // Reset the bus to wake up the EEPROM (this may not be needed)
-  w1_reset_bus(sl->master);
+  if (id == 0 || !value) {
+    return -EINVAL;
+  }
 
-out_up:
-  mutex_unlock(&sl->master->bus_mutex);
+  down_read(&ds->lock);
+  if (ds->sl) {
+    error = w1_b3_record_update(ds->sl, id, value, length);
+  }
+  up_read(&ds->lock);
 
-  return count;
+  return error;
 }
+EXPORT_SYMBOL_GPL(w1_ds2432_record_write);
 
-static ssize_t write_protect_pages_03_write(struct file *filp,
-                                            struct kobject *kobj,
-                                            struct bin_attribute *bin_attr,
-                                            char *buf, loff_t off,
-                                            size_t count) {
-  return 0;
+int w1_ds2432_record_delete(struct w1_ds2432 *ds, u8 id) {
+  int error = -ENODEV;
+
+  if (id == 0) {
+    return -EINVAL;
+  }
+
+  down_read(&ds->lock);
+  if (ds->sl) {
+    error = w1_b3_record_update(ds->sl, id, NULL, 0);
+  }
+  up_read(&ds->lock);
+
+  return error;
 }
+EXPORT_SYMBOL_GPL(w1_ds2432_record_delete);
 
-static BIN_ATTR_RW(write_protect_pages_03, 1);
+int w1_ds2432_counter_read(struct w1_ds2432 *ds, unsigned int offset,
+                           unsigned int blocks, u32 *value) {
+  int error = -ENODEV;
 
-//
-// Register page - user byte
-// 008Ah User byte, self-protecting - Protection activated by code AAh or 55h
-//
+  down_read(&ds->lock);
+  if (ds->sl) {
+    error = w1_b3_counter_read(ds->sl, offset, blocks, value);
+  }
+  up_read(&ds->lock);
 
-static ssize_t user_byte_read(struct file *filp, struct kobject *kobj,
-                              struct bin_attribute *bin_attr, char *buf,
-                              loff_t off, size_t count) {
-  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  return error;
+}
+EXPORT_SYMBOL_GPL(w1_ds2432_counter_read);
 
-  mutex_lock(&sl->master->bus_mutex);
+int w1_ds2432_counter_add(struct w1_ds2432 *ds, unsigned int offset,
+                          unsigned int blocks, u32 amount, u32 *value) {
+  int error = -ENODEV;
 
-  if (w1_reset_select_slave(sl)) {
-    count = -EIO;
-    goto out_up;
+  down_read(&ds->lock);
+  if (ds->sl) {
+    error = w1_b3_counter_add(ds->sl, offset, blocks, amount, value);
   }
+  up_read(&ds->lock);
 
-  w1_ds2432_read_memory(sl, W1_DS2432_REGISTER_PAGE_ADDR + 2 + off, buf, count);
-out_up:
-  mutex_unlock(&sl->master->bus_mutex);
+  return error;
+}
+EXPORT_SYMBOL_GPL(w1_ds2432_counter_add);
+
+static void w1_ds2432_async_work(struct work_struct *work) {
+  struct w1_ds2432_async *req =
+      container_of(work, struct w1_ds2432_async, work);
+
+  switch (req->op) {
+  case W1_DS2432_ASYNC_READ:
+    req->result = w1_ds2432_read(req->ds, req->off, req->buf, req->count);
+    break;
+  case W1_DS2432_ASYNC_WRITE:
+    req->result = w1_ds2432_write(req->ds, req->off, req->buf, req->count);
+    break;
+  case W1_DS2432_ASYNC_READ_AUTHENTICATED:
+    req->result = w1_ds2432_read_authenticated(req->ds, req->off, req->buf);
+    break;
+  default:
+    req->result = -EINVAL;
+  }
 
-  return count;
+  w1_ds2432_put(req->ds);
+  complete(&req->done);
 }
 
-static ssize_t user_byte_write(struct file *filp, struct kobject *kobj,
-                               struct bin_attribute *bin_attr, char *buf,
-                               loff_t off, size_t count) {
-  return 0;
+static void w1_ds2432_async_submit(struct w1_ds2432 *ds, int op,
+                                   unsigned int off, void *buf, size_t count,
+                                   struct w1_ds2432_async *req) {
+  kref_get(&ds->ref);
+
+  req->ds = ds;
+  req->op = op;
+  req->off = off;
+  req->buf = buf;
+  req->count = count;
+  req->result = 0;
+  init_completion(&req->done);
+  INIT_WORK(&req->work, w1_ds2432_async_work);
+
+  // Bus operations take milliseconds each.
+  queue_work(system_long_wq, &req->work);
 }
 
-static BIN_ATTR_RW(user_byte, 1);
+void w1_ds2432_read_async(struct w1_ds2432 *ds, unsigned int off, void *buf,
+                          size_t count, struct w1_ds2432_async *req) {
+  w1_ds2432_async_submit(ds, W1_DS2432_ASYNC_READ, off, buf, count, req);
+}
+EXPORT_SYMBOL_GPL(w1_ds2432_read_async);
 
-//
-// Register page - factory byte (read only)
-// 008Bh Factory byte (read only) - Reads either AAh or 55h
-//
+void w1_ds2432_write_async(struct w1_ds2432 *ds, unsigned int off,
+                           const void *buf, size_t count,
+                           struct w1_ds2432_async *req) {
+  w1_ds2432_async_submit(ds, W1_DS2432_ASYNC_WRITE, off, (void *)buf, count,
+                         req);
+}
+EXPORT_SYMBOL_GPL(w1_ds2432_write_async);
 
-static ssize_t factory_byte_read(struct file *filp, struct kobject *kobj,
-                                 struct bin_attribute *bin_attr, char *buf,
-                                 loff_t off, size_t count) {
-  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+void w1_ds2432_read_authenticated_async(struct w1_ds2432 *ds,
+                                        unsigned int page, u8 *data,
+                                        struct w1_ds2432_async *req) {
+  w1_ds2432_async_submit(ds, W1_DS2432_ASYNC_READ_AUTHENTICATED, page, data,
+                         W1_DS2432_PAGE_SIZE, req);
+}
+EXPORT_SYMBOL_GPL(w1_ds2432_read_authenticated_async);
 
-  mutex_lock(&sl->master->bus_mutex);
+int w1_ds2432_wait(struct w1_ds2432_async *req) {
+  wait_for_completion(&req->done);
 
-  if (w1_reset_select_slave(sl)) {
-    count = -EIO;
-    goto out_up;
+  return req->result;
+}
+EXPORT_SYMBOL_GPL(w1_ds2432_wait);
+
+/*
+ * Secret rotation jobs. A job runs one worker per master, so the masters
+ * rotate in parallel while the devices of each go one after the other; each
+ * worker only holds the bus for one device at a time.
+ */
+
+struct w1_ds2432_rotation_work {
+  struct work_struct work;
+  struct list_head entry;
+  unsigned int count;
+  struct w1_ds2432 *devices[];
+};
+
+static DEFINE_MUTEX(w1_ds2432_rotation_lock);
+static struct w1_ds2432_rotation w1_ds2432_rotation;
+
+static void w1_ds2432_rotation_work(struct work_struct *work) {
+  struct w1_ds2432_rotation_work *rotation_work =
+      container_of(work, struct w1_ds2432_rotation_work, work);
+  struct w1_ds2432_rotation *job = &w1_ds2432_rotation;
+  unsigned int i;
+  int result;
+
+  for (i = 0; i < rotation_work->count; i++) {
+    struct w1_ds2432 *ds = rotation_work->devices[i];
+
+    if (!READ_ONCE(job->cancel)) {
+      down_read(&ds->lock);
+      result = ds->sl ? w1_b3_rotate(ds->sl, job) : -ENOENT;
+      up_read(&ds->lock);
+
+      if (result != -ENOENT) {
+        atomic_inc(&job->total);
+        atomic_inc(result > 0    ? &job->rotated
+                   : result == 0 ? &job->skipped
+                                 : &job->failed);
+      }
+    }
+
+    w1_ds2432_put(ds);
   }
 
-  w1_ds2432_read_memory(sl, W1_DS2432_REGISTER_PAGE_ADDR + 3 + off, buf, count);
-out_up:
-  mutex_unlock(&sl->master->bus_mutex);
+  kfree(rotation_work);
 
-  return count;
+  if (atomic_dec_and_test(&job->workers)) {
+    mutex_lock(&w1_ds2432_rotation_lock);
+    job->running = false;
+    memzero_explicit(job->value, sizeof(job->value));
+    mutex_unlock(&w1_ds2432_rotation_lock);
+  }
 }
 
-static BIN_ATTR_RO(factory_byte, 1);
+// Parse "<rule>:<argument>" into the job.
+static int w1_ds2432_rotation_parse_rule(char *rule,
+                                         struct w1_ds2432_rotation *job) {
+  char *kind = strsep(&rule, ":");
+  char *value = rule;
 
-//
-// Register page - EPROM mode for page 1
-// 008Ch User byte/EPROM mode control for page 1 - Mode activated by code AAh or
-// 55h
-//
+  if (!value) {
+    return -EINVAL;
+  }
 
-static ssize_t eprom_mode_page_1_read(struct file *filp, struct kobject *kobj,
-                                      struct bin_attribute *bin_attr, char *buf,
-                                      loff_t off, size_t count) {
-  return 0;
-}
+  if (!strcmp(kind, "secret")) {
+    job->rule = W1_DS2432_ROTATE_SECRET;
+  } else if (!strcmp(kind, "derive")) {
+    job->rule = W1_DS2432_ROTATE_DERIVE;
+  } else if (!strcmp(kind, "next")) {
+    job->rule = W1_DS2432_ROTATE_NEXT;
+    kind = strsep(&value, ":");
+    if (!value || kstrtou8(kind, 10, &job->page) ||
+        job->page >= W1_DS2432_PAGE_COUNT) {
+      return -EINVAL;
+    }
+  } else {
+    return -EINVAL;
+  }
+
+  if (strlen(value) != 2 * sizeof(job->value) ||
+      hex2bin(job->value, value, sizeof(job->value))) {
+    return -EINVAL;
+  }
 
-static ssize_t eprom_mode_page_1_write(struct file *filp, struct kobject *kobj,
-                                       struct bin_attribute *bin_attr,
-                                       char *buf, loff_t off, size_t count) {
   return 0;
 }
 
-static BIN_ATTR_RW(eprom_mode_page_1, 1);
+// Take a reference on every attached slave, in one work item per master.
+static int w1_ds2432_rotation_collect(struct list_head *works) {
+  struct w1_ds2432_rotation_work *rotation_work, *tmp;
+  struct w1_ds2432_master *bus;
+  struct w1_b3_data *b3_data;
+  unsigned int i;
+  int error = 0;
 
-//
-// Register page - write protect page 0
-// 008Dh User byte/Write-protect page 0 only - Protection activated by code AAh
-// or 55h
-//
+  mutex_lock(&w1_ds2432_masters_lock);
+  list_for_each_entry(bus, &w1_ds2432_masters, entry) {
+    mutex_lock(&bus->lock);
+    rotation_work = kzalloc(struct_size(rotation_work, devices,
+                                        bus->slave_count),
+                            GFP_KERNEL);
+    if (rotation_work) {
+      list_for_each_entry(b3_data, &bus->slaves, bus_entry) {
+        kref_get(&b3_data->handle->ref);
+        rotation_work->devices[rotation_work->count++] = b3_data->handle;
+      }
+      list_add_tail(&rotation_work->entry, works);
+    }
+    mutex_unlock(&bus->lock);
 
-static ssize_t write_protect_page_0_read(struct file *filp,
-                                         struct kobject *kobj,
-                                         struct bin_attribute *bin_attr,
-                                         char *buf, loff_t off, size_t count) {
-  return 0;
-}
+    if (!rotation_work) {
+      error = -ENOMEM;
+      break;
+    }
+  }
+  mutex_unlock(&w1_ds2432_masters_lock);
 
-static ssize_t write_protect_page_0_write(struct file *filp,
-                                          struct kobject *kobj,
-                                          struct bin_attribute *bin_attr,
-                                          char *buf, loff_t off, size_t count) {
-  return 0;
+  if (error < 0) {
+    list_for_each_entry_safe(rotation_work, tmp, works, entry) {
+      for (i = 0; i < rotation_work->count; i++) {
+        w1_ds2432_put(rotation_work->devices[i]);
+      }
+      list_del(&rotation_work->entry);
+      kfree(rotation_work);
+    }
+  }
+
+  return error;
 }
 
-static BIN_ATTR_RW(write_protect_page_0, 1);
+// Accepts "<job id> <device set> <rule>" to start a job, or "cancel". The
+// device set is "all", "rom:<hex prefix>" or "mfg:<hex id>", the rule
+// "secret:<secret>", "derive:<master key>" or "next:<page>:<partial secret>".
+static int w1_ds2432_rotate_set(const char *val,
+                                const struct kernel_param *kp) {
+  struct w1_ds2432_rotation *job = &w1_ds2432_rotation;
+  struct w1_ds2432_rotation_work *rotation_work, *tmp;
+  struct w1_ds2432_rotation parsed = {0};
+  char *line, *spec, *id, *set, *kind;
+  unsigned int workers = 0;
+  LIST_HEAD(works);
+  int error;
+
+  line = kstrdup(val, GFP_KERNEL);
+  if (!line) {
+    return -ENOMEM;
+  }
 
-//
-// Register page - manufacturer id
-// 008Eh to 008Fh User Bytes/Manufacturer ID - Function depends on factory byte
-//
+  spec = strim(line);
 
-static ssize_t manufacturer_id_read(struct file *filp, struct kobject *kobj,
-                                    struct bin_attribute *bin_attr, char *buf,
-                                    loff_t off, size_t count) {
-  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  if (!strcmp(spec, "cancel")) {
+    mutex_lock(&w1_ds2432_rotation_lock);
+    if (job->running) {
+      WRITE_ONCE(job->cancel, true);
+    }
+    mutex_unlock(&w1_ds2432_rotation_lock);
+    error = 0;
+    goto out;
+  }
 
-  mutex_lock(&sl->master->bus_mutex);
+  id = strsep(&spec, " ");
+  set = strsep(&spec, " ");
+  if (!spec || kstrtou32(id, 0, &parsed.id) || parsed.id == 0) {
+    error = -EINVAL;
+    goto out;
+  }
 
-  if (w1_reset_select_slave(sl)) {
-    count = -EIO;
-    goto out_up;
+  error = -EINVAL;
+  if (!strcmp(set, "all")) {
+    error = 0;
+  } else {
+    kind = strsep(&set, ":");
+    if (set) {
+      error = w1_ds2432_parse_match(kind, set, parsed.match, &parsed.match_len,
+                                    &parsed.manufacturer_id);
+    }
+  }
+  if (error == 0) {
+    error = w1_ds2432_rotation_parse_rule(strim(spec), &parsed);
+  }
+  if (error < 0) {
+    goto out;
   }
 
-  w1_ds2432_read_memory(sl, W1_DS2432_REGISTER_PAGE_ADDR + 6 + off, buf, count);
-out_up:
-  mutex_unlock(&sl->master->bus_mutex);
+  mutex_lock(&w1_ds2432_rotation_lock);
 
-  return count;
-}
+  if (job->running) {
+    error = -EBUSY;
+    goto out_unlock;
+  }
 
-static ssize_t manufacturer_id_write(struct file *filp, struct kobject *kobj,
-                                     struct bin_attribute *bin_attr, char *buf,
-                                     loff_t off, size_t count) {
-  return 0;
-}
+  error = w1_ds2432_rotation_collect(&works);
+  if (error < 0) {
+    goto out_unlock;
+  }
 
-static BIN_ATTR_RW(manufacturer_id, 2);
+  list_for_each_entry(rotation_work, &works, entry) {
+    workers++;
+  }
 
-//
-// Register page - registration number
-// 0090h to 0097h 64-Bit Registration Number (Alternate readout)
-//
+  memcpy(job, &parsed, sizeof(*job));
+  atomic_set(&job->workers, workers);
+  job->running = workers > 0;
+  if (!job->running) {
+    memzero_explicit(job->value, sizeof(job->value));
+  }
 
-static ssize_t registration_number_read(struct file *filp, struct kobject *kobj,
-                                        struct bin_attribute *bin_attr,
-                                        char *buf, loff_t off, size_t count) {
-  struct w1_slave *sl = kobj_to_w1_slave(kobj);
+  // The module exit path drains the workqueue, so the workers cannot outlive
+  // the module.
+  list_for_each_entry_safe(rotation_work, tmp, &works, entry) {
+    list_del(&rotation_work->entry);
+    INIT_WORK(&rotation_work->work, w1_ds2432_rotation_work);
+    queue_work(w1_ds2432_wq, &rotation_work->work);
+  }
 
-  mutex_lock(&sl->master->bus_mutex);
+out_unlock:
+  mutex_unlock(&w1_ds2432_rotation_lock);
+out:
+  memzero_explicit(&parsed, sizeof(parsed));
+  kzfree(line);
 
-  if (w1_reset_select_slave(sl)) {
-    count = -EIO;
-    goto out_up;
+  return error;
+}
+
+static int w1_ds2432_rotate_get(char *buffer, const struct kernel_param *kp) {
+  struct w1_ds2432_rotation *job = &w1_ds2432_rotation;
+  const char *state;
+  int len;
+
+  mutex_lock(&w1_ds2432_rotation_lock);
+  if (!job->id) {
+    len = scnprintf(buffer, PAGE_SIZE, "none\n");
+  } else {
+    state = job->running ? "running"
+            : job->cancel ? "cancelled"
+                          : "finished";
+    len = scnprintf(buffer, PAGE_SIZE,
+                    "job %u %s: %d devices, %d rotated, %d skipped, "
+                    "%d failed\n",
+                    job->id, state, atomic_read(&job->total),
+                    atomic_read(&job->rotated), atomic_read(&job->skipped),
+                    atomic_read(&job->failed));
   }
+  mutex_unlock(&w1_ds2432_rotation_lock);
 
-  w1_ds2432_read_memory(sl, W1_DS2432_REGISTER_PAGE_ADDR + 8 + off, buf, count);
-out_up:
-  mutex_unlock(&sl->master->bus_mutex);
+  return len;
+}
 
-  return count;
+static const struct kernel_param_ops w1_ds2432_rotate_ops = {
+    .set = w1_ds2432_rotate_set,
+    .get = w1_ds2432_rotate_get,
+};
+
+module_param_cb(rotate, &w1_ds2432_rotate_ops, NULL, 0600);
+MODULE_PARM_DESC(rotate, "start a secret rotation job (<id> all|rom:<hex>|"
+                         "mfg:<hex> secret:<secret>|derive:<master key>|"
+                         "next:<page>:<partial secret>) or cancel it");
+
+/*
+ * nvmem provider. Consumers get the data memory through the same request
+ * queue as the eeprom attribute, so reads are served from the cache and
+ * writes are authenticated with the slave's secret.
+ */
+
+static int w1_b3_nvmem_read(void *priv, unsigned int off, void *val,
+                            size_t bytes) {
+  ssize_t result = w1_b3_queue_io(priv, false, off, val, bytes);
+
+  return result < 0 ? result : 0;
 }
 
-static BIN_ATTR_RO(registration_number, 8);
+static int w1_b3_nvmem_write(void *priv, unsigned int off, void *val,
+                             size_t bytes) {
+  ssize_t result = w1_b3_queue_io(priv, true, off, val, bytes);
 
-static struct bin_attribute *w1_ds2432_bin_attributes[] = {
-    &bin_attr_eeprom,
-    &bin_attr_secret,
-    &bin_attr_secret_sync,
-    &bin_attr_register_page,
-    // Register page break-down
-    &bin_attr_write_protect_secret,
-    &bin_attr_write_protect_pages_03,
-    &bin_attr_user_byte,
-    &bin_attr_factory_byte,
-    &bin_attr_eprom_mode_page_1,
-    &bin_attr_write_protect_page_0,
-    &bin_attr_manufacturer_id,
-    &bin_attr_registration_number,
-    NULL,
-};
+  return result < 0 ? result : 0;
+}
 
-static const struct attribute_group w1_ds2432_group = {
-    .bin_attrs = w1_ds2432_bin_attributes,
-};
+static void w1_b3_nvmem_register(struct w1_slave *sl) {
+  struct w1_b3_data *b3_data = sl->family_data;
+  struct nvmem_config config = {
+      .dev = &sl->dev,
+      .name = dev_name(&sl->dev),
+      .id = -1,
+      .owner = THIS_MODULE,
+      .size = W1_DS2432_DATA_MEMORY_SIZE,
+      .word_size = 1,
+      .stride = 1,
+      .priv = sl,
+      .reg_read = w1_b3_nvmem_read,
+      .reg_write = w1_b3_nvmem_write,
+  };
+  struct nvmem_device *nvmem;
+
+  nvmem = nvmem_register(&config);
+  if (IS_ERR(nvmem)) {
+    // Not fatal: the sysfs interface works without it.
+    dev_warn(&sl->dev, "nvmem registration failed: %ld\n", PTR_ERR(nvmem));
+    return;
+  }
 
-static const struct attribute_group *w1_b3_groups[] = {
-    &w1_ds2432_group,
-    NULL,
-};
+  b3_data->nvmem = nvmem;
+}
 
 static int w1_b3_add_slave(struct w1_slave *sl) {
   struct w1_b3_data *data;
+  int error;
 
   data = kzalloc(sizeof(struct w1_b3_data), GFP_KERNEL);
   if (!data) {
     return -ENOMEM;
   }
 
+  data->handle = kzalloc(sizeof(*data->handle), GFP_KERNEL);
+  if (!data->handle) {
+    kfree(data);
+    return -ENOMEM;
+  }
+
+  kref_init(&data->handle->ref);
+  init_rwsem(&data->handle->lock);
+  data->handle->sl = sl;
+
   sl->family_data = data;
+  data->sl = sl;
+  mutex_init(&data->queue_lock);
+  INIT_LIST_HEAD(&data->queue);
+  mutex_init(&data->update_lock);
+  mutex_init(&data->fields_lock);
+  mutex_init(&data->script_lock);
+  INIT_WORK(&data->key_work, w1_b3_key_work);
 
   memcpy(data->registration_number, &sl->reg_num, 8);
 
+  data->read_mode = min_t(unsigned int, read_mode, W1_DS2432_READ_MAC);
+  data->ecc = READ_ONCE(ecc);
+  data->link_pin = W1_DS2432_LINK_AUTO;
+
+  // The cache is loaded on first use, not to touch the bus here.
+  data->regmap = regmap_init(&sl->dev, &w1_ds2432_regmap_bus, sl,
+                             &w1_ds2432_regmap_config);
+  if (IS_ERR(data->regmap)) {
+    error = PTR_ERR(data->regmap);
+    goto err_handle;
+  }
+
+  // Pick the secret now from the secret table or the master key, so the slave
+  // is ready for authenticated writes without any per-device setup. Deriving
+  // is pure host computation; a table match costs one authenticated read.
+  w1_b3_lock(sl);
+  w1_b3_secret(sl);
+  w1_b3_unlock(sl);
+
+  error = w1_ds2432_bus_attach(sl);
+  if (error < 0) {
+    goto err_regmap;
+  }
+
+  w1_b3_nvmem_register(sl);
+
+  w1_b3_fields_apply(sl);
+
   return 0;
+
+err_regmap:
+  regmap_exit(data->regmap);
+err_handle:
+  w1_ds2432_put(data->handle);
+  kfree(data);
+  sl->family_data = NULL;
+  return error;
 }
 
 static void w1_b3_remove_slave(struct w1_slave *sl) {
+  struct w1_b3_data *data = sl->family_data;
+
+  if (data->nvmem) {
+    nvmem_unregister(data->nvmem);
+  }
+
+  w1_ds2432_bus_detach(sl);
+
+  // Once detached, a field_schema update no longer reaches this slave.
+  mutex_lock(&data->fields_lock);
+  w1_b3_fields_remove(data);
+  mutex_unlock(&data->fields_lock);
+
+  // Wait for in-kernel users still running an operation, then cut them off.
+  down_write(&data->handle->lock);
+  data->handle->sl = NULL;
+  up_write(&data->handle->lock);
+  w1_ds2432_put(data->handle);
+
+  regmap_exit(data->regmap);
+
+  kfree(data->script);
+  kfree(data->script_output);
+
+  // Once the key is dropped, key_work can no longer be queued.
+  w1_b3_lock(sl);
+  w1_b3_drop_key(data);
+  w1_b3_unlock(sl);
+  cancel_work_sync(&data->key_work);
+
+  memzero_explicit(data->secret, sizeof(data->secret));
+  memzero_explicit(data->mac_template, sizeof(data->mac_template));
   kfree(sl->family_data);
   sl->family_data = NULL;
 }
@@ -1038,7 +6811,36 @@ static struct w1_family w1_family_b3 = {
     .fops   = &w1_b3_fops,
 };
 
-module_w1_family(w1_family_b3);
+static int __init w1_ds2432_init(void) {
+  int error;
+
+  w1_ds2432_wq = alloc_workqueue("w1_ds2432", WQ_UNBOUND, 0);
+  if (!w1_ds2432_wq) {
+    return -ENOMEM;
+  }
+
+  error = w1_register_family(&w1_family_b3);
+  if (error < 0) {
+    destroy_workqueue(w1_ds2432_wq);
+  }
+
+  return error;
+}
+
+static void __exit w1_ds2432_exit(void) {
+  // A running rotation job stops after the devices in progress.
+  mutex_lock(&w1_ds2432_rotation_lock);
+  if (w1_ds2432_rotation.running) {
+    WRITE_ONCE(w1_ds2432_rotation.cancel, true);
+  }
+  mutex_unlock(&w1_ds2432_rotation_lock);
+
+  w1_unregister_family(&w1_family_b3);
+  destroy_workqueue(w1_ds2432_wq);
+}
+
+module_init(w1_ds2432_init);
+module_exit(w1_ds2432_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Benjamin Vanheuverzwijn <bvanheu@gmail.com>");
@@ -0,0 +1,119 @@
+/*
+ *	w1_ds2432.h - in-kernel interface of the w1 family B3 (DS2432) driver
+ *
+ * Copyright (c) 2017 Benjamin Vanheuverzwijn <bvanheu@gmail.com>
+ *
+ * This source code is licensed under the GNU General Public License,
+ * Version 2. See the file COPYING for more details.
+ */
+
+#ifndef __W1_DS2432_H
+#define __W1_DS2432_H
+
+#include <linux/completion.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+#define W1_DS2432_DATA_MEMORY_SIZE      0x80
+#define W1_DS2432_PAGE_SIZE             0x20
+
+// Longest record value the record store can hold.
+#define W1_DS2432_RECORD_MAX_LEN        124
+
+// Handle on a DS2432, obtained with w1_ds2432_get(). It stays valid after the
+// device is gone, every operation then fails with -ENODEV.
+struct w1_ds2432;
+
+/**
+ * Find an attached DS2432 by its 64-bit registration number (family code
+ * first, CRC last, as found in the ROM) and take a reference on it.
+ *
+ * Returns NULL when no such device is attached.
+ */
+struct w1_ds2432 *w1_ds2432_get(const u8 *registration_number);
+void w1_ds2432_put(struct w1_ds2432 *ds);
+
+/*
+ * Synchronous operations. They sleep, and return 0 or a negative error.
+ */
+
+// Read the data memory, through the driver cache.
+int w1_ds2432_read(struct w1_ds2432 *ds, unsigned int off, void *buf,
+                   size_t count);
+
+// Write the data memory with authenticated copies; partial 8-byte blocks
+// keep their other bytes.
+int w1_ds2432_write(struct w1_ds2432 *ds, unsigned int off, const void *buf,
+                    size_t count);
+
+/**
+ * Read one page with its MAC and check it against the device secret.
+ *
+ * Returns 0 when the device is genuine and `data` (W1_DS2432_PAGE_SIZE bytes)
+ * holds the page, -EACCES when the MAC does not match, another negative error
+ * when the page could not be read.
+ */
+int w1_ds2432_read_authenticated(struct w1_ds2432 *ds, unsigned int page,
+                                 u8 *data);
+
+// Read and authenticate the whole data memory in one bus session, each page
+// with its own challenge. `image` (W1_DS2432_DATA_MEMORY_SIZE bytes) receives
+// the data; returns 0 when every page is genuine, -EACCES otherwise.
+int w1_ds2432_authenticate_device(struct w1_ds2432 *ds, u8 *image);
+
+/*
+ * Record store, see the README. Record IDs go from 1 to 253.
+ */
+
+// Copy at most `size` bytes of record `id`; returns the record length,
+// -ENOENT without such record, -ENODATA when the device holds no store.
+int w1_ds2432_record_read(struct w1_ds2432 *ds, u8 id, void *buf,
+                          size_t size);
+// Create or replace record `id`, writing only the blocks that change.
+int w1_ds2432_record_write(struct w1_ds2432 *ds, u8 id, const void *value,
+                           size_t length);
+int w1_ds2432_record_delete(struct w1_ds2432 *ds, u8 id);
+
+/*
+ * Usage counters over `blocks` (at least 2) 8-byte blocks at `offset` (a
+ * multiple of 8).
+ * Each increment programs a single block, rotating over the region.
+ */
+
+int w1_ds2432_counter_read(struct w1_ds2432 *ds, unsigned int offset,
+                           unsigned int blocks, u32 *value);
+// Add `amount`, atomically with respect to the other updates of the device;
+// `value` (may be NULL) receives the new count.
+int w1_ds2432_counter_add(struct w1_ds2432 *ds, unsigned int offset,
+                          unsigned int blocks, u32 amount, u32 *value);
+
+/*
+ * Asynchronous operations. The caller owns the request, which must stay
+ * around until its completion fires; the result is then in `result`.
+ * w1_ds2432_wait() waits for it and returns it.
+ */
+
+struct w1_ds2432_async {
+  struct work_struct work;
+  struct completion done;
+  int result;
+
+  // Private to the driver.
+  struct w1_ds2432 *ds;
+  int op;
+  unsigned int off;
+  void *buf;
+  size_t count;
+};
+
+void w1_ds2432_read_async(struct w1_ds2432 *ds, unsigned int off, void *buf,
+                          size_t count, struct w1_ds2432_async *req);
+void w1_ds2432_write_async(struct w1_ds2432 *ds, unsigned int off,
+                           const void *buf, size_t count,
+                           struct w1_ds2432_async *req);
+void w1_ds2432_read_authenticated_async(struct w1_ds2432 *ds,
+                                        unsigned int page, u8 *data,
+                                        struct w1_ds2432_async *req);
+int w1_ds2432_wait(struct w1_ds2432_async *req);
+
+#endif /* __W1_DS2432_H */